@@ -0,0 +1,3157 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "libsfs.h"
+
+
+int sfs_verbose;
+
+#define log(fmt, ...) \
+    do { \
+        if (sfs_verbose) \
+            printf(" # " fmt, ##__VA_ARGS__); \
+    } while (0)
+
+
+/* Flags kept in the size field of an entry, see inline_data() and
+ * compressed_read(). */
+#define SFS_INLINE      0x40000000
+#define SFS_COMPRESSED  0x20000000
+#define SFS_FILESIZE(entry) \
+    ((entry)->size & SFS_SIZEMASK & ~(SFS_INLINE | SFS_COMPRESSED))
+
+/* The block table is written back in parts of a block each. */
+#define BLOCKTBL_PAGE_NENTRIES  (SFS_BLOCK_SIZE / sizeof(blockidx_t))
+#define BLOCKTBL_NPAGES \
+    ((SFS_BLOCKTBL_NENTRIES + BLOCKTBL_PAGE_NENTRIES - 1) / BLOCKTBL_PAGE_NENTRIES)
+
+#define SFS_CLUSTER_BLOCKS  4
+#define SFS_CLUSTER_SIZE    (SFS_CLUSTER_BLOCKS * SFS_BLOCK_SIZE - sizeof(struct sfs_cluster))
+#define SFS_CCACHE_NSLOTS   64
+#define SFS_CINDEX_NSLOTS   8
+
+struct sfs_cluster {
+    uint16_t csize;     /* Bytes stored after the header */
+    uint16_t rawsize;   /* Bytes of file data; csize == rawsize if stored raw */
+};
+
+/* The first block of every cluster of a compressed file, see cindex_get(). */
+struct cindex {
+    blockidx_t first_block;     /* Of the file; 0 marks an empty slot */
+    unsigned long gen;          /* chain_gen the index was built at */
+    size_t nclusters;
+    size_t cap;
+    blockidx_t *heads;
+};
+
+#define RECLAIM_MIN_BLOCKS  2048
+#define RECLAIM_QUEUE_LEN   64
+#define RECLAIM_BATCH       256
+
+#define WB_MAX_FILES    256
+#define WB_MAX_EXTENT   (1024 * 1024)
+#define WB_MAX_DIRTY    (4 * 1024 * 1024)
+
+struct wbuf {
+    unsigned entry_off;     /* Entry of the file, 0 once it is unlinked */
+    unsigned nopen;         /* Slot is free if 0 */
+    char *data;
+    size_t start;           /* File offset of data[0] */
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Everything kept in memory for an open image.
+ */
+struct sfs_image {
+    int fd;
+    int flags;
+
+    /*
+     * All operations run under one big lock: callers may use the image from
+     * several threads, and the background defragmenter moves blocks around
+     * underneath them. The time of the last operation is kept so the
+     * defragmenter can stay out of the way while the filesystem is busy.
+     */
+    pthread_mutex_t lock;
+    struct timespec last_op;
+
+    /* See sfs_image_set_lock_hook() */
+    void (*lock_hook)(void *arg);
+    void *lock_hook_arg;
+
+    blockidx_t blocktbl[SFS_BLOCKTBL_NENTRIES];
+    uint16_t refcnt[SFS_BLOCKTBL_NENTRIES];
+    char blocktbl_dirty[BLOCKTBL_NPAGES];
+
+    /* Block 0 is never the start of a cluster, so head == 0 marks an empty slot. */
+    struct {
+        blockidx_t head;
+        uint16_t nblocks;
+        uint16_t rawsize;
+        char data[SFS_CLUSTER_BLOCKS * SFS_BLOCK_SIZE];
+    } ccache[SFS_CCACHE_NSLOTS];
+
+    /* Blocks taken by the cluster starting at each block, or 0 if not known,
+     * so walking over clusters does not need to read their headers. Any write
+     * to a block forgets its entry, see disk_write(). */
+    uint8_t cluster_nblocks[SFS_BLOCKTBL_NENTRIES];
+
+    /* Bumped on every change to the block table, which invalidates all
+     * cluster indexes. */
+    unsigned long chain_gen;
+    struct cindex cindex[SFS_CINDEX_NSLOTS];
+
+    blockidx_t reclaim_queue[RECLAIM_QUEUE_LEN];
+    unsigned reclaim_first, reclaim_count;
+    int reclaim_running;
+    int reclaim_stop;
+    pthread_cond_t reclaim_cond;
+    pthread_t reclaim_tid;
+
+    int defrag_running;
+    int defrag_stop;
+    pthread_cond_t defrag_cond;
+    pthread_t defrag_tid;
+
+    /* The file defrag_entry() is moving while the lock is dropped, and
+     * whether it was changed in the meantime (see entry_write()). */
+    unsigned defrag_off;
+    int defrag_abort;
+
+    struct wbuf wbufs[WB_MAX_FILES];
+    size_t wb_dirty;
+
+    /* Files opened read-only, which need no buffer (see file_open()) */
+    struct sfs_file *ro_files;
+};
+
+/*
+ * An open file. If it is writable, it holds a reference to the write buffer of
+ * the file; otherwise it keeps the offset of the entry itself, and is linked
+ * into ro_files of the image.
+ */
+struct sfs_file {
+    struct sfs_image *img;
+    struct wbuf *wb;
+    unsigned entry_off;         /* 0 once the file is unlinked */
+    struct sfs_file *prev, *next;
+};
+
+
+/*
+ * Read or write part of the image. There is no way to recover from a failed
+ * access to the image halfway through an operation, so it is fatal.
+ */
+static void disk_read(struct sfs_image *img, void *buf, size_t size,
+                      off_t offset)
+{
+    if (pread(img->fd, buf, size, offset) != (ssize_t)size) {
+        perror("sfs: reading image");
+        abort();
+    }
+}
+
+static void disk_write(struct sfs_image *img, const void *buf, size_t size,
+                       off_t offset)
+{
+    if (pwrite(img->fd, buf, size, offset) != (ssize_t)size) {
+        perror("sfs: writing image");
+        abort();
+    }
+
+    if (size > 0 && (size_t)offset + size > SFS_DATA_OFF) {
+        size_t first = (size_t)offset > SFS_DATA_OFF
+                       ? (offset - SFS_DATA_OFF) / SFS_BLOCK_SIZE : 0;
+        size_t last = (offset + size - 1 - SFS_DATA_OFF) / SFS_BLOCK_SIZE;
+
+        if (last >= SFS_BLOCKTBL_NENTRIES)
+            last = SFS_BLOCKTBL_NENTRIES - 1;
+        if (first <= last)
+            memset(&img->cluster_nblocks[first], 0, last - first + 1);
+    }
+}
+
+
+/*
+ * This is a helper function that is optional, but highly recomended you
+ * implement and use. Given a path, it looks it up on disk. It will return 0 on
+ * success, and a non-zero value on error (e.g., the file did not exist).
+ * The resulting directory entry is placed in the memory pointed to by
+ * ret_entry. Additionally it can return the offset of that direntry on disk in
+ * ret_entry_off, which you can use to update the entry and write it back to
+ * disk (e.g., rmdir, unlink, truncate, write).
+ *
+ * You can start with implementing this function to work just for paths in the
+ * root entry, and later modify it to also work for paths with subdirectories.
+ * This way, all of your other functions can use this helper and will
+ * automatically support subdirectories. To make this function support
+ * subdirectories, we recommend you refactor this function to be recursive, and
+ * take the current directory as argument as well. For example:
+ *
+ *  static int get_entry_rec(const char *path, const struct sfs_entry *parent,
+ *                           size_t parent_nentries, blockidx_t parent_blockidx,
+ *                           struct sfs_entry *ret_entry,
+ *                           unsigned *ret_entry_off)
+ *
+ * Here parent is the directory it is currently searching (at first the rootdir,
+ * later the subdir). The parent_nentries tells the function how many entries
+ * there are in the directory (SFS_ROOTDIR_NENTRIES or SFS_DIR_NENTRIES).
+ * Finally, the parent_blockidx contains the blockidx of the given directory on
+ * the disk, which will help in calculating ret_entry_off.
+ */
+static int get_entry_rec(struct sfs_image *img, const char *path,
+                         const struct sfs_entry *parent, size_t parent_nentries,
+                         blockidx_t parent_blockidx,
+                         struct sfs_entry *ret_entry, unsigned *ret_entry_off)
+{
+    (void)parent;
+
+    /* Split off the first component of the path; `path` is the part that is
+     * still left to resolve below this directory. */
+    char name[SFS_FILENAME_MAX];
+
+    while (*path == '/')
+        path++;
+    const char *rest = path + strcspn(path, "/");
+    size_t len = rest - path;
+
+    if (len == 0)
+        return 1;
+    if (len >= SFS_FILENAME_MAX)
+        return -ENAMETOOLONG;
+    memcpy(name, path, len);
+    name[len] = '\0';
+    while (*rest == '/')
+        rest++;
+
+    struct sfs_entry dir[parent_nentries];
+    unsigned dir_off = parent_nentries == SFS_ROOTDIR_NENTRIES
+                       ? SFS_ROOTDIR_OFF
+                       : SFS_DATA_OFF + parent_blockidx * SFS_BLOCK_SIZE;
+
+    disk_read(img, dir, parent_nentries * sizeof(struct sfs_entry), dir_off);
+
+    for (unsigned i = 0; i < parent_nentries; i++) {
+        if (dir[i].filename[0] == '\0' || strcmp(dir[i].filename, name) != 0)
+            continue;
+
+        if (*rest == '\0') {
+            *ret_entry = dir[i];
+            if (ret_entry_off != NULL)
+                *ret_entry_off = dir_off + i * sizeof(struct sfs_entry);
+            return 0;
+        }
+
+        /* Only directories have anything below them. */
+        if (!(dir[i].size & SFS_DIRECTORY))
+            return 1;
+        return get_entry_rec(img, rest, &dir[i], SFS_DIR_NENTRIES,
+                             dir[i].first_block, ret_entry, ret_entry_off);
+    }
+
+    return 1;
+}
+
+
+/*
+ * Tiny files are stored inline in their directory entry: the contents live in
+ * the unused tail of the filename field, right after the terminating NUL. A
+ * read is then served from the entry the lookup already fetched, and the file
+ * does not take up a data block or block table entry. Such entries are marked
+ * with SFS_INLINE in the size field (like SFS_DIRECTORY), and have first_block
+ * set to SFS_BLOCKIDX_END. Once the file outgrows the space left by its name it
+ * is moved to regular blocks by inline_promote().
+ */
+static const char zero_block[SFS_BLOCK_SIZE];
+
+static size_t inline_capacity(const struct sfs_entry *entry)
+{
+    return sizeof(entry->filename) - strlen(entry->filename) - 1;
+}
+
+static char *inline_data(struct sfs_entry *entry)
+{
+    return entry->filename + strlen(entry->filename) + 1;
+}
+
+
+/*
+ * In-memory copy of the block table, loaded when the image is opened.
+ * blocktbl_set() only updates the copy and marks the part of the table it
+ * lives in as dirty; blocktbl_flush() writes all dirty parts back, merging
+ * adjacent ones into a single write. This is done at the end of every
+ * operation, and before an entry is made to point at newly linked blocks.
+ * Next to the table lives a reference count side table: refcnt[i] is the
+ * number of links pointing at block i, counting both the block table and the
+ * first_block of directory entries. Normally every block in use has a count of
+ * 1, but cloned files share (a suffix of) their chain, giving the shared
+ * blocks a higher count. The counts are not stored on disk; blocktbl_load()
+ * rebuilds them from the directory tree.
+ */
+static blockidx_t blocktbl_get(struct sfs_image *img, blockidx_t blockidx)
+{
+    return img->blocktbl[blockidx];
+}
+
+static void blocktbl_set(struct sfs_image *img, blockidx_t blockidx,
+                         blockidx_t next)
+{
+    img->blocktbl[blockidx] = next;
+    img->blocktbl_dirty[blockidx / BLOCKTBL_PAGE_NENTRIES] = 1;
+    img->chain_gen++;
+}
+
+static void blocktbl_flush(struct sfs_image *img)
+{
+    for (size_t page = 0; page < BLOCKTBL_NPAGES; ) {
+        if (!img->blocktbl_dirty[page]) {
+            page++;
+            continue;
+        }
+
+        size_t from = page * BLOCKTBL_PAGE_NENTRIES;
+        while (page < BLOCKTBL_NPAGES && img->blocktbl_dirty[page])
+            img->blocktbl_dirty[page++] = 0;
+
+        size_t to = page * BLOCKTBL_PAGE_NENTRIES;
+        if (to > SFS_BLOCKTBL_NENTRIES)
+            to = SFS_BLOCKTBL_NENTRIES;
+
+        disk_write(img, &img->blocktbl[from], (to - from) * sizeof(blockidx_t),
+                   SFS_BLOCKTBL_OFF + from * sizeof(blockidx_t));
+    }
+}
+
+/*
+ * Write back a directory entry, after making sure any blocks it links to are
+ * linked up on disk.
+ */
+static void entry_write(struct sfs_image *img, const struct sfs_entry *entry,
+                        off_t entry_off)
+{
+    if (entry_off == img->defrag_off)
+        img->defrag_abort = 1;
+
+    blocktbl_flush(img);
+    disk_write(img, entry, sizeof(struct sfs_entry), entry_off);
+}
+
+
+static void chain_put(struct sfs_image *img, blockidx_t blockidx);
+
+static void refcnt_scan_dir(struct sfs_image *img, off_t dir_off,
+                            unsigned n_entries)
+{
+    struct sfs_entry dir[n_entries];
+    disk_read(img, dir, n_entries * sizeof(struct sfs_entry), dir_off);
+
+    for (unsigned int i = 0; i < n_entries; i++) {
+        if (strlen(dir[i].filename) < 1 || (dir[i].size & SFS_INLINE))
+            continue;
+        /* A file of size 0 can still own blocks, left by a write that ran
+         * out of space. */
+        if (dir[i].first_block == SFS_BLOCKIDX_EMPTY ||
+            dir[i].first_block >= SFS_BLOCKTBL_NENTRIES)
+            continue;
+
+        img->refcnt[dir[i].first_block]++;
+
+        if (dir[i].size & SFS_DIRECTORY)
+            refcnt_scan_dir(img, SFS_DATA_OFF + dir[i].first_block * SFS_BLOCK_SIZE,
+                            SFS_DIR_NENTRIES);
+    }
+}
+
+/*
+ * Read the block table from disk and rebuild the reference counts.
+ */
+static void blocktbl_load(struct sfs_image *img)
+{
+    disk_read(img, img->blocktbl, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    memset(img->refcnt, 0, sizeof(img->refcnt));
+
+    for (unsigned int i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        if (img->blocktbl[i] != SFS_BLOCKIDX_EMPTY && img->blocktbl[i] < SFS_BLOCKTBL_NENTRIES)
+            img->refcnt[img->blocktbl[i]]++;
+    }
+
+    refcnt_scan_dir(img, SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES);
+
+    /* Chains nothing points to were left behind by an unlink whose blocks
+     * were still queued for the reclaimer when we went down. */
+    for (unsigned int i = 1; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        if (img->blocktbl[i] != SFS_BLOCKIDX_EMPTY && img->refcnt[i] == 0) {
+            log("reclaiming orphaned chain at %x\n", i);
+            img->refcnt[i] = 1;
+            chain_put(img, i);
+        }
+    }
+    blocktbl_flush(img);
+}
+
+
+/*
+ * Find a free data block and mark it as the end of a chain. Its contents are
+ * left as-is; callers that do not overwrite the whole block must zero it.
+ * Block 0 is never handed out, since a link to it would be indistinguishable
+ * from SFS_BLOCKIDX_EMPTY.
+ * Returns 0 on success, -ENOSPC if the disk is full.
+ */
+static int alloc_block(struct sfs_image *img, blockidx_t *ret_blockidx)
+{
+    for (unsigned int i = 1; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        if (img->blocktbl[i] == SFS_BLOCKIDX_EMPTY) {
+            blocktbl_set(img, i, SFS_BLOCKIDX_END);
+            img->refcnt[i] = 1;
+            *ret_blockidx = i;
+            return 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+
+/*
+ * Files flagged with SFS_COMPRESSED store their data in clusters: up to
+ * SFS_CLUSTER_SIZE bytes of the file are compressed together and stored as a
+ * cluster header followed by the compressed bytes, taking up as many blocks of
+ * the chain as needed (at most SFS_CLUSTER_BLOCKS). Data that does not
+ * compress is stored as-is, so a cluster never takes more room than the
+ * plain data would. Reads only decompress the clusters they touch, and recently
+ * used clusters are kept decompressed in a small cache indexed by the first
+ * block of the cluster.
+ */
+static void ccache_invalidate(struct sfs_image *img, blockidx_t head)
+{
+    if (img->ccache[head % SFS_CCACHE_NSLOTS].head == head)
+        img->ccache[head % SFS_CCACHE_NSLOTS].head = 0;
+}
+
+
+/*
+ * Drop one reference to the chain starting at `blockidx`. Blocks are freed
+ * until we reach one that is still referenced from elsewhere: that block, and
+ * therefore the rest of the chain, is shared with another file. Freeing only
+ * touches the in-memory table, the changes reach the disk with the next
+ * blocktbl_flush().
+ * At most `max` blocks are handled; the block to continue from (which has not
+ * had its reference dropped yet) is returned, or SFS_BLOCKIDX_END when done.
+ */
+static blockidx_t chain_put_some(struct sfs_image *img, blockidx_t blockidx,
+                                 unsigned max)
+{
+    while (blockidx != SFS_BLOCKIDX_END && blockidx < SFS_BLOCKTBL_NENTRIES) {
+        if (max-- == 0)
+            return blockidx;
+        if (--img->refcnt[blockidx] > 0)
+            break;
+
+        blockidx_t next = img->blocktbl[blockidx];
+        blocktbl_set(img, blockidx, SFS_BLOCKIDX_EMPTY);
+        ccache_invalidate(img, blockidx);
+        blockidx = next;
+    }
+
+    return SFS_BLOCKIDX_END;
+}
+
+static void chain_put(struct sfs_image *img, blockidx_t blockidx)
+{
+    chain_put_some(img, blockidx, UINT_MAX);
+}
+
+
+/*
+ * Chains of very large files are not freed right away by unlink and truncate,
+ * but handed to a background reclaimer (see reclaim_thread()) so the operation
+ * can return immediately. Until then the blocks stay allocated; should we go
+ * down first, blocktbl_load() finds the orphaned chains and frees them.
+ */
+/*
+ * Drop a chain of about `nblocks` blocks that is no longer linked from its file.
+ */
+static void chain_release(struct sfs_image *img, blockidx_t blockidx,
+                          size_t nblocks)
+{
+    if (blockidx == SFS_BLOCKIDX_END)
+        return;
+
+    if (img->reclaim_running && nblocks >= RECLAIM_MIN_BLOCKS &&
+        img->reclaim_count < RECLAIM_QUEUE_LEN) {
+        log("deferring free of %zu blocks at %x\n", nblocks, blockidx);
+        img->reclaim_queue[(img->reclaim_first + img->reclaim_count++) % RECLAIM_QUEUE_LEN] = blockidx;
+        pthread_cond_signal(&img->reclaim_cond);
+        return;
+    }
+
+    chain_put(img, blockidx);
+}
+
+
+/*
+ * Give the file a private copy of the shared block `blockidx`, which is linked
+ * from `prev` (or from the entry itself if prev is SFS_BLOCKIDX_END). The copy
+ * keeps pointing at the rest of the shared chain. Only blocks up to the one
+ * being written are copied, so a clone diverges lazily from its source.
+ * If `whole` is set the caller overwrites the entire block, and its old
+ * contents need not be copied.
+ * Returns 0 on success, < 0 on error.
+ */
+static int block_unshare(struct sfs_image *img, struct sfs_entry *entry,
+                         blockidx_t prev, blockidx_t *blockidx, int whole)
+{
+    blockidx_t old = *blockidx;
+    blockidx_t copy;
+    int res = alloc_block(img, &copy);
+    if (res < 0)
+        return res;
+
+    log("unshare block %x -> %x\n", old, copy);
+
+    if (!whole) {
+        char data[SFS_BLOCK_SIZE];
+        disk_read(img, data, SFS_BLOCK_SIZE, SFS_DATA_OFF + old * SFS_BLOCK_SIZE);
+        disk_write(img, data, SFS_BLOCK_SIZE, SFS_DATA_OFF + copy * SFS_BLOCK_SIZE);
+    }
+
+    blockidx_t next = img->blocktbl[old];
+    blocktbl_set(img, copy, next);
+    if (next != SFS_BLOCKIDX_END)
+        img->refcnt[next]++;
+
+    if (prev == SFS_BLOCKIDX_END)
+        entry->first_block = copy;
+    else
+        blocktbl_set(img, prev, copy);
+
+    img->refcnt[old]--;
+    *blockidx = copy;
+    return 0;
+}
+
+
+/*
+ * Walk `n` blocks into the chain of `entry`. Shared blocks on the way are
+ * unshared (which in turn makes the next block shared, so everything up to the
+ * end of the walk ends up private), as the caller will change the link out of
+ * the last one. On return *prev is the last block walked over (SFS_BLOCKIDX_END
+ * if n is 0) and *head the block after it.
+ * Returns 0 on success, < 0 on error.
+ */
+static int chain_seek(struct sfs_image *img, struct sfs_entry *entry, size_t n,
+                      blockidx_t *prev, blockidx_t *head)
+{
+    *prev = SFS_BLOCKIDX_END;
+    *head = entry->first_block;
+
+    for (size_t i = 0; i < n; i++) {
+        if (img->refcnt[*head] > 1) {
+            int res = block_unshare(img, entry, *prev, head, 0);
+            if (res < 0)
+                return res;
+        }
+        *prev = *head;
+        *head = blocktbl_get(img, *head);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Resolve the directory that should contain `path`. The offset and number of
+ * entries of that directory are returned in ret_dir_off and ret_nentries, and
+ * the last component of the path is copied into ret_name.
+ * Returns 0 on success, < 0 on error.
+ */
+static int get_parent_dir(struct sfs_image *img, const char *path,
+                          off_t *ret_dir_off, unsigned *ret_nentries,
+                          char *ret_name)
+{
+    const char *name = strrchr(path, '/');
+
+    if (name == NULL || name[1] == '\0')
+        return -EINVAL;
+    if (strlen(name + 1) >= 58)
+        return -ENAMETOOLONG;
+
+    strcpy(ret_name, name + 1);
+
+    if (name == path) {
+        *ret_dir_off = SFS_ROOTDIR_OFF;
+        *ret_nentries = SFS_ROOTDIR_NENTRIES;
+        return 0;
+    }
+
+    char parentPath[100];
+    struct sfs_entry parent;
+
+    if ((size_t)(name - path) >= sizeof(parentPath))
+        return -ENAMETOOLONG;
+
+    memcpy(parentPath, path, name - path);
+    parentPath[name - path] = '\0';
+
+    if (get_entry_rec(img, parentPath, NULL, SFS_ROOTDIR_NENTRIES, 0, &parent, NULL) != 0)
+        return -ENOENT;
+    if (!(parent.size & SFS_DIRECTORY))
+        return -ENOTDIR;
+
+    *ret_dir_off = SFS_DATA_OFF + parent.first_block * SFS_BLOCK_SIZE;
+    *ret_nentries = SFS_DIR_NENTRIES;
+    return 0;
+}
+
+
+/*
+ * Write `size` bytes of `buf` at `offset` into the block chain of `entry`,
+ * extending the chain with zeroed blocks where needed. Blocks shared with a
+ * clone are copied before being written to. The caller is
+ * responsible for updating the size of the entry and writing it back.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_write_blocks(struct sfs_image *img, struct sfs_entry *entry,
+                             const char *buf, size_t size, off_t offset)
+{
+    blockidx_t prev = SFS_BLOCKIDX_END;
+    blockidx_t blockID = entry->first_block;
+    off_t blockStart = 0;
+    off_t end = offset + size;
+
+    while (blockStart < end) {
+        int whole = offset <= blockStart && end >= blockStart + SFS_BLOCK_SIZE;
+
+        if (blockID == SFS_BLOCKIDX_END) {
+            int res = alloc_block(img, &blockID);
+            if (res < 0)
+                return res;
+
+            if (!whole)
+                disk_write(img, zero_block, SFS_BLOCK_SIZE, SFS_DATA_OFF + blockID * SFS_BLOCK_SIZE);
+
+            if (prev == SFS_BLOCKIDX_END)
+                entry->first_block = blockID;
+            else
+                blocktbl_set(img, prev, blockID);
+        }
+
+        else if (img->refcnt[blockID] > 1) {
+            int res = block_unshare(img, entry, prev, &blockID, whole);
+            if (res < 0)
+                return res;
+        }
+
+        if (blockStart + SFS_BLOCK_SIZE > offset) {
+            off_t from = offset > blockStart ? offset : blockStart;
+            off_t to = end < blockStart + SFS_BLOCK_SIZE ? end : blockStart + SFS_BLOCK_SIZE;
+
+            disk_write(img, buf + (from - offset), to - from,
+                       SFS_DATA_OFF + blockID * SFS_BLOCK_SIZE + (from - blockStart));
+        }
+
+        prev = blockID;
+        blockID = blocktbl_get(img, blockID);
+        blockStart += SFS_BLOCK_SIZE;
+    }
+
+    return 0;
+}
+
+
+/*
+ * A small LZ77 codec in the style of the LZ4 block format. The output is a
+ * series of sequences, each made up of a token byte (literal length in the
+ * high nibble, match length - 4 in the low nibble, 15 meaning more length
+ * bytes follow), the literals, and a 2-byte offset back to the match. The
+ * last sequence only has literals.
+ * Returns the compressed size, or 0 if it does not fit in `cap` bytes.
+ */
+#define LZ_MINMATCH     4
+#define LZ_HASH_BITS    10
+
+static size_t lz_put_length(char *dst, size_t op, size_t cap, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= cap)
+            return 0;
+        dst[op++] = (char)255;
+    }
+    if (op >= cap)
+        return 0;
+    dst[op++] = len;
+    return op;
+}
+
+static size_t lz_put_sequence(char *dst, size_t op, size_t cap,
+                              const char *lit, size_t nlit,
+                              size_t offset, size_t mlen)
+{
+    size_t mcode = mlen ? mlen - LZ_MINMATCH : 0;
+
+    if (op >= cap)
+        return 0;
+    dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+
+    if (nlit >= 15 && !(op = lz_put_length(dst, op, cap, nlit - 15)))
+        return 0;
+    if (op + nlit > cap)
+        return 0;
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+
+    if (!mlen)
+        return op;
+
+    if (op + 2 > cap)
+        return 0;
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+
+    if (mcode >= 15 && !(op = lz_put_length(dst, op, cap, mcode - 15)))
+        return 0;
+    return op;
+}
+
+static size_t lz_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+    uint16_t table[1 << LZ_HASH_BITS] = { 0 };   /* Position + 1, 0 if unset */
+    size_t ip = 0, anchor = 0, op = 0;
+
+    while (ip + LZ_MINMATCH <= len) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, sizeof(seq));
+
+        unsigned h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+
+        if (ref == 0 || memcmp(src + ref - 1, src + ip, LZ_MINMATCH) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        size_t mlen = LZ_MINMATCH;
+        while (ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+
+        op = lz_put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!op)
+            return 0;
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    return lz_put_sequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+/*
+ * Returns 0 if `src` decompresses to exactly `len` bytes, -1 otherwise.
+ */
+static int lz_decompress(const char *src, size_t srclen, char *dst, size_t len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    size_t ip = 0, op = 0;
+
+    while (ip < srclen) {
+        unsigned token = in[ip++];
+        size_t nlit = token >> 4;
+        size_t mlen = token & 15;
+
+        if (nlit == 15) {
+            do {
+                if (ip >= srclen)
+                    return -1;
+                nlit += in[ip];
+            } while (in[ip++] == 255);
+        }
+        if (ip + nlit > srclen || op + nlit > len)
+            return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == srclen)
+            break;
+
+        if (ip + 2 > srclen)
+            return -1;
+        size_t offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+
+        if (mlen == 15) {
+            do {
+                if (ip >= srclen)
+                    return -1;
+                mlen += in[ip];
+            } while (in[ip++] == 255);
+        }
+        mlen += LZ_MINMATCH;
+
+        if (offset == 0 || offset > op || op + mlen > len)
+            return -1;
+        for (size_t i = 0; i < mlen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+
+    return op == len ? 0 : -1;
+}
+
+
+static unsigned cluster_nblocks(const struct sfs_cluster *hdr)
+{
+    return (sizeof(struct sfs_cluster) + hdr->csize + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+}
+
+/*
+ * Return the number of blocks taken by the cluster starting at `head`, using
+ * the cache if possible so that skipping over a cluster needs no disk access.
+ */
+static unsigned cluster_skip(struct sfs_image *img, blockidx_t head)
+{
+    struct sfs_cluster hdr;
+
+    if (img->cluster_nblocks[head])
+        return img->cluster_nblocks[head];
+    if (img->ccache[head % SFS_CCACHE_NSLOTS].head == head)
+        return img->ccache[head % SFS_CCACHE_NSLOTS].nblocks;
+
+    disk_read(img, &hdr, sizeof(hdr), SFS_DATA_OFF + head * SFS_BLOCK_SIZE);
+    unsigned nblocks = cluster_nblocks(&hdr);
+    if (nblocks <= SFS_CLUSTER_BLOCKS)
+        img->cluster_nblocks[head] = nblocks;
+    return nblocks;
+}
+
+/*
+ * Return the index of the clusters of the (compressed) file starting at
+ * `first_block`, building it if there is none that is up to date. Random
+ * reads then go straight to the cluster they need, instead of walking over
+ * every cluster before it. The index stays valid until the next change to
+ * the block table.
+ * Returns NULL if out of memory.
+ */
+static const struct cindex *cindex_get(struct sfs_image *img,
+                                       blockidx_t first_block)
+{
+    struct cindex *ci = &img->cindex[first_block % SFS_CINDEX_NSLOTS];
+
+    if (ci->first_block == first_block && ci->gen == img->chain_gen)
+        return ci;
+
+    ci->first_block = 0;
+    ci->nclusters = 0;
+
+    for (blockidx_t head = first_block; head != SFS_BLOCKIDX_END;) {
+        if (ci->nclusters == SFS_BLOCKTBL_NENTRIES)
+            break;
+        if (ci->nclusters == ci->cap) {
+            size_t cap = ci->cap ? ci->cap * 2 : 64;
+            blockidx_t *heads = realloc(ci->heads, cap * sizeof(*heads));
+            if (heads == NULL)
+                return NULL;
+            ci->heads = heads;
+            ci->cap = cap;
+        }
+        ci->heads[ci->nclusters++] = head;
+
+        for (unsigned int i = cluster_skip(img, head); i > 0; i--)
+            head = blocktbl_get(img, head);
+    }
+
+    ci->first_block = first_block;
+    ci->gen = img->chain_gen;
+    return ci;
+}
+
+/*
+ * Read and decompress the cluster starting at `head` into `raw`.
+ * Returns the number of bytes of file data in the cluster, or < 0 on error.
+ */
+static int cluster_read(struct sfs_image *img, blockidx_t head, char *raw)
+{
+    unsigned slot = head % SFS_CCACHE_NSLOTS;
+    char stored[SFS_CLUSTER_BLOCKS * SFS_BLOCK_SIZE];
+    struct sfs_cluster hdr;
+
+    if (img->ccache[slot].head == head) {
+        memcpy(raw, img->ccache[slot].data, img->ccache[slot].rawsize);
+        return img->ccache[slot].rawsize;
+    }
+
+    disk_read(img, stored, SFS_BLOCK_SIZE, SFS_DATA_OFF + head * SFS_BLOCK_SIZE);
+    memcpy(&hdr, stored, sizeof(hdr));
+
+    unsigned nblocks = cluster_nblocks(&hdr);
+    if (nblocks > SFS_CLUSTER_BLOCKS || hdr.rawsize > SFS_CLUSTER_SIZE)
+        return -EIO;
+
+    blockidx_t blockID = head;
+    for (unsigned int i = 1; i < nblocks; i++) {
+        blockID = blocktbl_get(img, blockID);
+        disk_read(img, stored + i * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE,
+                  SFS_DATA_OFF + blockID * SFS_BLOCK_SIZE);
+    }
+
+    const char *payload = stored + sizeof(hdr);
+    if (hdr.csize == hdr.rawsize)
+        memcpy(raw, payload, hdr.rawsize);
+    else if (lz_decompress(payload, hdr.csize, raw, hdr.rawsize) < 0)
+        return -EIO;
+
+    img->ccache[slot].head = head;
+    img->ccache[slot].nblocks = nblocks;
+    img->ccache[slot].rawsize = hdr.rawsize;
+    memcpy(img->ccache[slot].data, raw, hdr.rawsize);
+    img->cluster_nblocks[head] = nblocks;
+
+    return hdr.rawsize;
+}
+
+/*
+ * Compress `rawsize` bytes of `raw` into a freshly allocated run of blocks and
+ * splice it into the chain in place of the cluster starting at *head (which
+ * may be SFS_BLOCKIDX_END when appending), linked from *prev. On return *prev
+ * is the last block of the new cluster and *head the start of the next one.
+ * Returns 0 on success, < 0 on error.
+ */
+static int cluster_replace(struct sfs_image *img, struct sfs_entry *entry,
+                           blockidx_t *prev, blockidx_t *head, const char *raw,
+                           size_t rawsize)
+{
+    char stored[SFS_CLUSTER_BLOCKS * SFS_BLOCK_SIZE] = { 0 };
+    struct sfs_cluster hdr;
+
+    size_t csize = lz_compress(raw, rawsize, stored + sizeof(hdr), rawsize - 1);
+    if (csize == 0) {
+        memcpy(stored + sizeof(hdr), raw, rawsize);
+        csize = rawsize;
+    }
+    hdr.csize = csize;
+    hdr.rawsize = rawsize;
+    memcpy(stored, &hdr, sizeof(hdr));
+
+    unsigned nblocks = cluster_nblocks(&hdr);
+    blockidx_t newHead = SFS_BLOCKIDX_END, tail = SFS_BLOCKIDX_END;
+
+    for (unsigned int i = 0; i < nblocks; i++) {
+        blockidx_t blockID;
+        int res = alloc_block(img, &blockID);
+        if (res < 0) {
+            chain_put(img, newHead);
+            return res;
+        }
+
+        disk_write(img, stored + i * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE,
+                   SFS_DATA_OFF + blockID * SFS_BLOCK_SIZE);
+
+        if (tail == SFS_BLOCKIDX_END)
+            newHead = blockID;
+        else
+            blocktbl_set(img, tail, blockID);
+        tail = blockID;
+    }
+
+    /* Find what follows the old cluster and hang it off the new one. */
+    blockidx_t oldHead = *head;
+    blockidx_t after = oldHead;
+    if (oldHead != SFS_BLOCKIDX_END) {
+        for (unsigned int i = cluster_skip(img, oldHead); i > 0; i--)
+            after = blocktbl_get(img, after);
+    }
+
+    blocktbl_set(img, tail, after);
+    if (after != SFS_BLOCKIDX_END)
+        img->refcnt[after]++;
+
+    if (*prev == SFS_BLOCKIDX_END)
+        entry->first_block = newHead;
+    else
+        blocktbl_set(img, *prev, newHead);
+
+    /* Drops the old cluster, unless it is still shared with a clone. */
+    if (oldHead != SFS_BLOCKIDX_END)
+        chain_put(img, oldHead);
+
+    unsigned slot = newHead % SFS_CCACHE_NSLOTS;
+    img->ccache[slot].head = newHead;
+    img->ccache[slot].nblocks = nblocks;
+    img->ccache[slot].rawsize = rawsize;
+    memcpy(img->ccache[slot].data, raw, rawsize);
+    img->cluster_nblocks[newHead] = nblocks;
+
+    *prev = tail;
+    *head = after;
+    return 0;
+}
+
+
+/*
+ * Read from a compressed file. `size` and `offset` must lie within the file.
+ * Returns the number of bytes read, or < 0 on error.
+ */
+static int compressed_read(struct sfs_image *img, const struct sfs_entry *entry,
+                           char *buf, size_t size, off_t offset)
+{
+    char raw[SFS_CLUSTER_SIZE];
+    size_t c = offset / SFS_CLUSTER_SIZE;
+    size_t clusterStart = c * SFS_CLUSTER_SIZE;
+    size_t bytesRead = 0;
+
+    const struct cindex *ci = cindex_get(img, entry->first_block);
+    if (ci == NULL)
+        return -ENOMEM;
+
+    while (bytesRead < size) {
+        if (c >= ci->nclusters)
+            return -EIO;
+
+        int rawsize = cluster_read(img, ci->heads[c++], raw);
+        if (rawsize < 0)
+            return rawsize;
+
+        size_t from = offset + bytesRead - clusterStart;
+        size_t chunk = rawsize - from;
+        if (chunk > size - bytesRead)
+            chunk = size - bytesRead;
+
+        memcpy(buf + bytesRead, raw + from, chunk);
+        bytesRead += chunk;
+        clusterStart += SFS_CLUSTER_SIZE;
+    }
+
+    return bytesRead;
+}
+
+
+/*
+ * Like chain_seek(), but walks over `n` clusters of a compressed file.
+ */
+static int cluster_seek(struct sfs_image *img, struct sfs_entry *entry,
+                        size_t n, blockidx_t *prev, blockidx_t *head)
+{
+    *prev = SFS_BLOCKIDX_END;
+    *head = entry->first_block;
+
+    for (size_t c = 0; c < n; c++) {
+        for (unsigned int i = cluster_skip(img, *head); i > 0; i--) {
+            if (img->refcnt[*head] > 1) {
+                int res = block_unshare(img, entry, *prev, head, 0);
+                if (res < 0)
+                    return res;
+            }
+            *prev = *head;
+            *head = blocktbl_get(img, *head);
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write into a compressed file by rewriting every cluster the write touches.
+ * If the write starts past the end of the file, the clusters in between are
+ * filled with zeroes. Blocks before the first rewritten cluster that are
+ * shared with a clone are unshared, since their links are updated.
+ * The caller is responsible for updating the size of the entry.
+ * Returns 0 on success, < 0 on error.
+ */
+static int compressed_write(struct sfs_image *img, struct sfs_entry *entry,
+                            const char *buf, size_t size, off_t offset)
+{
+    char raw[SFS_CLUSTER_SIZE];
+    size_t oldSize = SFS_FILESIZE(entry);
+    size_t end = offset + size;
+    size_t newSize = end > oldSize ? end : oldSize;
+    size_t first = ((size_t)offset < oldSize ? (size_t)offset : oldSize) / SFS_CLUSTER_SIZE;
+    size_t last = (end - 1) / SFS_CLUSTER_SIZE;
+
+    blockidx_t prev, head;
+
+    int res = cluster_seek(img, entry, first, &prev, &head);
+    if (res < 0)
+        return res;
+
+    for (size_t c = first; c <= last; c++) {
+        size_t clusterStart = c * SFS_CLUSTER_SIZE;
+        size_t newLen = newSize - clusterStart;
+        if (newLen > SFS_CLUSTER_SIZE)
+            newLen = SFS_CLUSTER_SIZE;
+
+        memset(raw, 0, sizeof(raw));
+        if (clusterStart < oldSize) {
+            int res = cluster_read(img, head, raw);
+            if (res < 0)
+                return res;
+        }
+
+        size_t from = (size_t)offset > clusterStart ? (size_t)offset : clusterStart;
+        size_t to = end < clusterStart + newLen ? end : clusterStart + newLen;
+        if (from < to)
+            memcpy(raw + (from - clusterStart), buf + (from - offset), to - from);
+
+        int res = cluster_replace(img, entry, &prev, &head, raw, newLen);
+        if (res < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write data into the blocks of a (non-inline) file, picking the layout based
+ * on whether it is compressed.
+ */
+static int file_write_data(struct sfs_image *img, struct sfs_entry *entry,
+                           const char *buf, size_t size, off_t offset)
+{
+    if (entry->size & SFS_COMPRESSED)
+        return compressed_write(img, entry, buf, size, offset);
+    return file_write_blocks(img, entry, buf, size, offset);
+}
+
+
+/*
+ * Move the contents of an inline file into a regular block chain. The entry is
+ * updated in memory and written back to disk at entry_off.
+ * Returns 0 on success, < 0 on error.
+ */
+static int inline_promote(struct sfs_image *img, struct sfs_entry *entry,
+                          unsigned entry_off)
+{
+    size_t fileSize = SFS_FILESIZE(entry);
+    char data[58];
+
+    log("promote %s (%zu bytes) to blocks\n", entry->filename, fileSize);
+
+    memcpy(data, inline_data(entry), fileSize);
+    memset(inline_data(entry), 0, inline_capacity(entry));
+
+    entry->first_block = SFS_BLOCKIDX_END;
+    entry->size &= SFS_COMPRESSED;
+
+    if (fileSize > 0) {
+        int res = file_write_data(img, entry, data, fileSize, 0);
+        if (res < 0)
+            return res;
+    }
+
+    entry->size |= fileSize;
+    entry_write(img, entry, entry_off);
+    return 0;
+}
+
+
+/*
+ * Shrink or grow the file described by `entry` to `size` bytes, and write the
+ * entry back to entry_off. Growing writes zeroes. When shrinking, the chain is
+ * cut after the last block (or cluster) still needed, and the tail is dropped
+ * in one go with chain_release().
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_truncate(struct sfs_image *img, struct sfs_entry *entry,
+                         unsigned entry_off, size_t size)
+{
+    size_t oldSize = SFS_FILESIZE(entry);
+    blockidx_t prev, head;
+    int res;
+
+    if (size == oldSize)
+        return 0;
+
+    if (entry->size & SFS_INLINE) {
+        if (size <= inline_capacity(entry)) {
+            char *data = inline_data(entry);
+
+            if (size > oldSize)
+                memset(data + oldSize, 0, size - oldSize);
+            else
+                memset(data + size, 0, oldSize - size);
+
+            entry->size = (entry->size & SFS_COMPRESSED) | SFS_INLINE | size;
+            entry_write(img, entry, entry_off);
+            return 0;
+        }
+
+        res = inline_promote(img, entry, entry_off);
+        if (res < 0)
+            return res;
+    }
+
+    if (size > oldSize) {
+        char *zeros = calloc(size - oldSize, 1);
+
+        res = file_write_data(img, entry, zeros, size - oldSize, oldSize);
+        free(zeros);
+        if (res == 0)
+            entry->size = (entry->size & SFS_COMPRESSED) | size;
+
+        entry_write(img, entry, entry_off);
+        return res;
+    }
+
+    if (entry->size & SFS_COMPRESSED) {
+        res = cluster_seek(img, entry, size / SFS_CLUSTER_SIZE, &prev, &head);
+
+        /* A partial last cluster is rewritten with just the part we keep. */
+        if (res == 0 && size % SFS_CLUSTER_SIZE) {
+            char raw[SFS_CLUSTER_SIZE];
+
+            res = cluster_read(img, head, raw);
+            if (res >= 0)
+                res = cluster_replace(img, entry, &prev, &head, raw, size % SFS_CLUSTER_SIZE);
+        }
+    }
+    else {
+        res = chain_seek(img, entry, (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE, &prev, &head);
+
+        /* Clear the rest of the last block, so growing the file again later
+         * reads back zeroes. */
+        if (res == 0 && size % SFS_BLOCK_SIZE)
+            disk_write(img, zero_block, SFS_BLOCK_SIZE - size % SFS_BLOCK_SIZE,
+                       SFS_DATA_OFF + prev * SFS_BLOCK_SIZE + size % SFS_BLOCK_SIZE);
+    }
+
+    if (res < 0) {
+        entry_write(img, entry, entry_off);
+        return res;
+    }
+
+    if (prev == SFS_BLOCKIDX_END)
+        entry->first_block = SFS_BLOCKIDX_END;
+    else
+        blocktbl_set(img, prev, SFS_BLOCKIDX_END);
+
+    entry->size = (entry->size & SFS_COMPRESSED) | size;
+    entry_write(img, entry, entry_off);
+
+    chain_release(img, head, (oldSize - size) / SFS_BLOCK_SIZE);
+    return 0;
+}
+
+
+/*
+ * Write `size` bytes of `buf` at `offset` into the file described by `entry`,
+ * and write the updated entry back to entry_off.
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int file_write(struct sfs_image *img, struct sfs_entry *entry,
+                      unsigned entry_off, const char *buf, size_t size,
+                      off_t offset)
+{
+    /* Nothing to do, and not even past the end of the file: a zero-length
+     * write does not extend it. */
+    if(size == 0){
+        return 0;
+    }
+
+    size_t oldSize = SFS_FILESIZE(entry);
+    size_t newSize = offset + size > oldSize ? offset + size : oldSize;
+
+    if(newSize > (size_t)SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE){
+        return -EFBIG;
+    }
+
+    if(entry->size & SFS_INLINE){
+
+        if(newSize <= inline_capacity(entry)){
+            char *data = inline_data(entry);
+
+            if((size_t)offset > oldSize){
+                memset(data + oldSize, 0, offset - oldSize);
+            }
+            memcpy(data + offset, buf, size);
+
+            entry->size = (entry->size & SFS_COMPRESSED) | SFS_INLINE | newSize;
+            entry_write(img, entry, entry_off);
+            return size;
+        }
+
+        int res = inline_promote(img, entry, entry_off);
+        if(res < 0){
+            return res;
+        }
+    }
+
+    int res = file_write_data(img, entry, buf, size, offset);
+    if(res < 0){
+        /* Keep whatever part of the chain did get allocated reachable. */
+        entry_write(img, entry, entry_off);
+        return res;
+    }
+
+    entry->size = (entry->size & SFS_COMPRESSED) | newSize;
+    entry_write(img, entry, entry_off);
+
+    return size;
+}
+
+
+/*
+ * Write-back cache. Every open file gets a buffer (shared between all opens of
+ * the same file, and identified by the offset of its entry) that collects
+ * writes in memory as long as each one overlaps or directly follows what is
+ * already buffered, as is the case for appends and sequential writes. Only
+ * when a write does not fit, the buffer grows past WB_MAX_EXTENT, or all
+ * buffers together hold more than WB_MAX_DIRTY, is the buffer written out, as
+ * one big write. This also happens when the file is synced or closed, and
+ * before anything else reads or changes the file on disk.
+ */
+static struct wbuf *wb_find(struct sfs_image *img, unsigned entry_off)
+{
+    for (unsigned int i = 0; i < WB_MAX_FILES; i++) {
+        if (img->wbufs[i].nopen > 0 && img->wbufs[i].entry_off == entry_off)
+            return &img->wbufs[i];
+    }
+    return NULL;
+}
+
+/*
+ * Return the size of the file including any buffered data.
+ */
+static size_t wb_size(struct sfs_image *img, const struct sfs_entry *entry,
+                      unsigned entry_off)
+{
+    struct wbuf *wb = wb_find(img, entry_off);
+    size_t size = SFS_FILESIZE(entry);
+
+    if (wb && wb->len > 0 && wb->start + wb->len > size)
+        size = wb->start + wb->len;
+    return size;
+}
+
+static int wb_flush(struct sfs_image *img, struct wbuf *wb)
+{
+    struct sfs_entry entry;
+    size_t len = wb->len;
+
+    if (len == 0)
+        return 0;
+
+    log("flush %zu bytes at %zu\n", len, wb->start);
+
+    wb->len = 0;
+    img->wb_dirty -= len;
+
+    if (wb->entry_off == 0)
+        return 0;
+
+    disk_read(img, &entry, sizeof(struct sfs_entry), wb->entry_off);
+    int res = file_write(img, &entry, wb->entry_off, wb->data, len, wb->start);
+    return res < 0 ? res : 0;
+}
+
+static int wb_flush_all(struct sfs_image *img)
+{
+    int res = 0;
+
+    for (unsigned int i = 0; i < WB_MAX_FILES; i++) {
+        int r = wb_flush(img, &img->wbufs[i]);
+        if (r < 0)
+            res = r;
+    }
+    return res;
+}
+
+/*
+ * Write out buffered data of the file at entry_off, if any, before the file is
+ * accessed directly.
+ */
+static int wb_sync(struct sfs_image *img, unsigned entry_off)
+{
+    struct wbuf *wb = wb_find(img, entry_off);
+    return wb ? wb_flush(img, wb) : 0;
+}
+
+static int wb_write(struct sfs_image *img, struct wbuf *wb, const char *buf,
+                    size_t size, off_t offset)
+{
+    size_t end = offset + size;
+
+    if (wb->entry_off == 0 || size == 0)
+        return size;
+    if (end > (size_t)SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE)
+        return -EFBIG;
+
+    if (wb->len > 0) {
+        size_t newStart = (size_t)offset < wb->start ? (size_t)offset : wb->start;
+        size_t newEnd = end > wb->start + wb->len ? end : wb->start + wb->len;
+
+        if ((size_t)offset > wb->start + wb->len || end < wb->start ||
+            newEnd - newStart > WB_MAX_EXTENT) {
+            int res = wb_flush(img, wb);
+            if (res < 0)
+                return res;
+        }
+    }
+
+    if (wb->len == 0)
+        wb->start = offset;
+
+    size_t newStart = (size_t)offset < wb->start ? (size_t)offset : wb->start;
+    size_t newEnd = end > wb->start + wb->len ? end : wb->start + wb->len;
+
+    if (newEnd - newStart > wb->cap) {
+        size_t cap = newEnd - newStart < 4096 ? 4096 : 2 * (newEnd - newStart);
+        char *data = realloc(wb->data, cap);
+        if (data == NULL)
+            return -ENOMEM;
+        wb->data = data;
+        wb->cap = cap;
+    }
+    if (newStart < wb->start) {
+        memmove(wb->data + (wb->start - newStart), wb->data, wb->len);
+    }
+
+    memcpy(wb->data + (offset - newStart), buf, size);
+    img->wb_dirty += (newEnd - newStart) - wb->len;
+    wb->start = newStart;
+    wb->len = newEnd - newStart;
+
+    if (img->wb_dirty > WB_MAX_DIRTY) {
+        int res = wb_flush_all(img);
+        if (res < 0)
+            return res;
+    }
+
+    return size;
+}
+
+/*
+ * Open the file at entry_off. A file opened for writing is attached to the
+ * buffer of the file, which also remembers where the entry is, so the number
+ * of files that can be open for writing at once is limited to WB_MAX_FILES.
+ * Files opened read-only take no buffer, and there is no limit on them.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_open(struct sfs_image *img, unsigned entry_off, int flags,
+                     struct sfs_file **ret_file)
+{
+    struct wbuf *wb = NULL;
+
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        wb = wb_find(img, entry_off);
+
+        for (unsigned int i = 0; wb == NULL && i < WB_MAX_FILES; i++) {
+            if (img->wbufs[i].nopen == 0) {
+                wb = &img->wbufs[i];
+                wb->entry_off = entry_off;
+                wb->len = 0;
+            }
+        }
+
+        if (wb == NULL)
+            return -ENFILE;
+    }
+
+    struct sfs_file *file = calloc(1, sizeof(struct sfs_file));
+    if (file == NULL)
+        return -ENOMEM;
+
+    file->img = img;
+    file->wb = wb;
+    if (wb != NULL) {
+        wb->nopen++;
+    }
+    else {
+        file->entry_off = entry_off;
+        file->next = img->ro_files;
+        if (img->ro_files)
+            img->ro_files->prev = file;
+        img->ro_files = file;
+    }
+
+    *ret_file = file;
+    return 0;
+}
+
+/*
+ * Detach all open files from the file at entry_off, or from every file if
+ * entry_off is 0, as it is going away. Buffered data is dropped, and the
+ * handles fail from now on.
+ */
+static void file_forget(struct sfs_image *img, unsigned entry_off)
+{
+    for (unsigned int i = 0; i < WB_MAX_FILES; i++) {
+        struct wbuf *wb = &img->wbufs[i];
+
+        if (wb->nopen > 0 && wb->entry_off != 0 &&
+            (entry_off == 0 || wb->entry_off == entry_off)) {
+            img->wb_dirty -= wb->len;
+            wb->len = 0;
+            wb->entry_off = 0;
+        }
+    }
+
+    for (struct sfs_file *file = img->ro_files; file != NULL; file = file->next) {
+        if (entry_off == 0 || file->entry_off == entry_off)
+            file->entry_off = 0;
+    }
+}
+
+/*
+ * Retrieve information about a file or directory.
+ * You should populate fields of `stbuf` with appropriate information if the
+ * file exists and is accessible, or return an error otherwise.
+ *
+ * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
+ * For files, you should at least set st_mode (with S_IFREG), st_nlink and
+ * st_size.
+ *
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_getattr(struct sfs_image *img, const char *path, struct stat *st)
+{
+    int res = -ENOENT;
+
+    log("getattr %s\n", path);
+
+    memset(st, 0, sizeof(struct stat));
+    /* Set owner to user/group who mounted the image */
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    /* Last accessed/modified just now */
+    st->st_atime = time(NULL);
+    st->st_mtime = time(NULL);
+
+    if (strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        res = 0;
+    }else{
+
+        struct sfs_entry entry;
+        unsigned entryOffset;
+
+        res = get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset);
+        if(res != 0){
+            return res < 0 ? res : -ENOENT;
+        }
+
+        if(entry.size & SFS_DIRECTORY){
+            log("is dir");
+            st->st_mode = S_IFDIR | 0755;
+            st->st_nlink = 2;
+        }
+        else {
+            log("is file");
+            st->st_mode = S_IFREG | 0755;
+            st->st_nlink = 1;
+            st->st_size = wb_size(img, &entry, entryOffset);
+        }   
+        res = 0;
+    }
+
+    return res;
+}
+
+
+/*
+ * Return directory contents for `path`. This function should simply fill the
+ * filenames - any additional information (e.g., whether something is a file or
+ * directory) is later retrieved through getattr calls.
+ * Use the function `filler` to add an entry to the directory. Use it like:
+ *  filler(arg, <dirname>);
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_readdir(struct sfs_image *img, const char *path, void *arg,
+                       sfs_dir_filler filler)
+{
+    log("readdir %s\n", path);
+
+    if(strcmp(path, "/") == 0){
+        struct sfs_entry rootdir[SFS_ROOTDIR_NENTRIES];
+        disk_read(img, rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+
+        for (unsigned int i=0; i < SFS_ROOTDIR_NENTRIES; i++){
+
+            if(strlen(rootdir[i].filename) > 0 && filler(arg, rootdir[i].filename)){
+                break;
+            }
+        }
+   }
+   else {
+
+        struct sfs_entry entry;
+
+        if (get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, NULL) != 0){
+            return -ENOENT;
+        }
+        if(!(entry.size & SFS_DIRECTORY)){
+            return -ENOTDIR;
+        }
+
+        struct sfs_entry temp[16];
+
+        disk_read(img, temp, SFS_DIR_SIZE, SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE);
+        
+        for(unsigned int i=0; i < 16; i++){
+            
+            if(strlen(temp[i].filename) > 0){
+                log("fill in entry %s", temp[i].filename);
+                if(filler(arg, temp[i].filename)){
+                    break;
+                }
+            } 
+        }
+
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read up to `size` bytes at `offset` from the file described by `entry`.
+ * Returns the number of bytes read, or < 0 on error.
+ */
+static int file_read(struct sfs_image *img, struct sfs_entry *entry, char *buf,
+                     size_t size, off_t offset)
+{
+    size_t fileSize = SFS_FILESIZE(entry);
+
+    if((size_t)offset >= fileSize){
+        return 0;
+    }
+    if(size > fileSize - offset){
+        size = fileSize - offset;
+    }
+
+    /* Tiny files are served straight from the entry we already have. */
+    if(entry->size & SFS_INLINE){
+        memcpy(buf, inline_data(entry) + offset, size);
+        return size;
+    }
+
+    if(entry->size & SFS_COMPRESSED){
+        return compressed_read(img, entry, buf, size, offset);
+    }
+        
+    blockidx_t blockID = entry->first_block;
+    size_t remainingBytes = size;
+    int bytesRead = 0;
+    off_t currOffset = offset;
+
+    while(currOffset >= SFS_BLOCK_SIZE){
+        blockID = blocktbl_get(img, blockID);
+        currOffset -= SFS_BLOCK_SIZE;
+    }
+
+    while(remainingBytes > 0){
+
+        size_t chunk = SFS_BLOCK_SIZE - currOffset;
+        if(chunk > remainingBytes){
+            chunk = remainingBytes;
+        }
+
+        disk_read(img, buf + bytesRead, chunk, SFS_DATA_OFF + blockID * SFS_BLOCK_SIZE + currOffset);
+        bytesRead += chunk;
+        remainingBytes -= chunk;
+
+        blockID = blocktbl_get(img, blockID);
+
+        log("block id: %x", blockID);
+
+        currOffset = 0;
+    }
+    
+    return bytesRead;    
+}
+
+
+/*
+ * Read contents of `path` into `buf` for  up to `size` bytes.
+ * Note that `size` may be bigger than the file actually is.
+ * Reading should start at offset `offset`; the OS will generally read your file
+ * in chunks of 4K byte.
+ * Returns the number of bytes read (writing into `buf`), or < 0 on error.
+ */
+static int sfs_read(struct sfs_image *img, const char *path, char *buf,
+                    size_t size, off_t offset)
+{
+    log("read %s size=%zu offset=%ld\n", path, size, offset);
+
+    struct sfs_entry entry;
+    unsigned entryOffset;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset) != 0){
+        return -ENOENT;
+    }
+
+    if(entry.size & SFS_DIRECTORY){
+        return -EISDIR;
+    }
+
+    /* Buffered writes go to disk first, so we read them back. */
+    struct wbuf *wb = wb_find(img, entryOffset);
+    if(wb != NULL && wb->len > 0){
+        int res = wb_flush(img, wb);
+        if(res < 0){
+            return res;
+        }
+        disk_read(img, &entry, sizeof(struct sfs_entry), entryOffset);
+    }
+
+    return file_read(img, &entry, buf, size, offset);
+}
+
+
+/*
+ * Create directory at `path`.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_mkdir(struct sfs_image *img, const char *path)
+{
+    log("mkdir %s\n", path);
+
+    char name[58];
+    off_t offset;
+    unsigned int n_entries;
+    struct sfs_entry entry;
+
+    int res = get_parent_dir(img, path, &offset, &n_entries, name);
+    if(res < 0){
+        return res;
+    }
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, NULL) == 0){
+        return -EEXIST;
+    }
+
+    struct sfs_entry dir[n_entries];
+    disk_read(img, dir, n_entries * sizeof(struct sfs_entry), offset);
+
+    unsigned int slot;
+    for(slot=0; slot<n_entries; slot++){
+        if(strlen(dir[slot].filename) < 1){
+            log("empty at: %u", slot);
+            break;
+        }
+    }
+    if(slot == n_entries){
+        return -ENOSPC;
+    }
+    offset += slot * sizeof(struct sfs_entry);
+    
+    /* Directories take two adjacent blocks. Block 0 is never used, so
+     * blockID1 == 0 means there was no free pair. */
+    blockidx_t blockID1 = 0;
+
+    for(unsigned int i = 1; i + 1 < SFS_BLOCKTBL_NENTRIES; i++){
+
+        if(blocktbl_get(img, i) == SFS_BLOCKIDX_EMPTY && blocktbl_get(img, i+1) == SFS_BLOCKIDX_EMPTY){
+            log("empty at %i and %i", i, i+1);
+
+            blockID1 = i;
+
+            blocktbl_set(img, i, i+1);
+            blocktbl_set(img, i+1, SFS_BLOCKIDX_END);
+            img->refcnt[i] = 1;
+            img->refcnt[i+1] = 1;
+
+            break;
+        }
+
+    }
+
+    if(blockID1 == 0){
+        return -ENOSPC;
+    }
+
+    struct sfs_entry new_dir[SFS_DIR_NENTRIES];
+
+    for(unsigned int i=0; i<SFS_DIR_NENTRIES; i++){
+        strcpy(new_dir[i].filename, "\0");
+        new_dir[i].first_block = SFS_BLOCKIDX_EMPTY;
+        new_dir[i].size = 0;
+    }
+
+    disk_write(img, new_dir, SFS_DIR_SIZE, SFS_DATA_OFF + blockID1 * SFS_BLOCK_SIZE);
+
+    struct sfs_entry new_entry;
+    strcpy(new_entry.filename, name);
+    new_entry.size = SFS_DIRECTORY;
+    new_entry.first_block = blockID1;
+
+    entry_write(img, &new_entry, offset);
+    
+
+    return 0;
+}
+
+
+/*
+ * Remove directory at `path`.
+ * Directories may only be removed if they are empty, otherwise this function
+ * should return -ENOTEMPTY.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_rmdir(struct sfs_image *img, const char *path)
+{
+    log("rmdir %s\n", path);
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+
+    int res = get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entry_off);
+    if(res != 0){
+        log("cant find dir");
+        return res < 0 ? res : -ENOENT;
+    }
+
+    if(!(entry.size & SFS_DIRECTORY)){
+        return -ENOTDIR;
+    }
+
+    struct sfs_entry dir[16];
+
+    disk_read(img, dir, SFS_DIR_SIZE, SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE);
+
+    for(unsigned int i=0; i<SFS_DIR_NENTRIES; i++){
+        if(strlen(dir[i].filename) > 0){
+            return -ENOTEMPTY;
+        }
+    }
+
+    /* entry_off is where the entry lives, in the root directory or in a
+     * subdirectory alike, so both are removed the same way: the entry first,
+     * then its blocks. */
+    blockidx_t blockID = entry.first_block;
+
+    struct sfs_entry new_entry;
+
+    memset(&new_entry, 0, sizeof(struct sfs_entry));
+    new_entry.first_block = SFS_BLOCKIDX_EMPTY;
+
+    entry_write(img, &new_entry, entry_off);
+
+    chain_put(img, blockID);
+
+    return 0;
+}
+
+
+/*
+ * Remove file at `path`.
+ * Can not be used to remove directories.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_unlink(struct sfs_image *img, const char *path)
+{
+    log("unlink %s\n", path);
+
+    struct sfs_entry entry;
+    unsigned entryOffset;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset) != 0){
+        return -ENOENT;
+    }
+
+    if(entry.size & SFS_DIRECTORY){
+        return -EISDIR;
+    }
+
+    /* Data still buffered for the file can simply be dropped. */
+    file_forget(img, entryOffset);
+
+    size_t fileSize = SFS_FILESIZE(&entry);
+    blockidx_t blockID = SFS_BLOCKIDX_END;
+
+    if(!(entry.size & SFS_INLINE) && entry.first_block != SFS_BLOCKIDX_EMPTY){
+        blockID = entry.first_block;
+    }
+
+    /* Unlink the entry first, so the blocks are never in use and free at the
+     * same time on disk. */
+    memset(&entry, 0, sizeof(struct sfs_entry));
+    entry.first_block = SFS_BLOCKIDX_EMPTY;
+    entry_write(img, &entry, entryOffset);
+
+    chain_release(img, blockID, fileSize / SFS_BLOCK_SIZE);
+
+    return 0;
+}
+
+
+/*
+ * Create an empty file at `path`, and open it if ret_file is given.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_create(struct sfs_image *img, const char *path,
+                      struct sfs_file **ret_file)
+{
+    log("create %s\n", path);
+
+    char name[58];
+    off_t dirOffset;
+    unsigned int n_entries;
+    struct sfs_entry entry;
+
+    int res = get_parent_dir(img, path, &dirOffset, &n_entries, name);
+    if(res < 0){
+        return res;
+    }
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, NULL) == 0){
+        return -EEXIST;
+    }
+
+    struct sfs_entry dir[n_entries];
+    disk_read(img, dir, n_entries * sizeof(struct sfs_entry), dirOffset);
+
+    for(unsigned int i=0; i<n_entries; i++){
+        if(strlen(dir[i].filename) < 1){
+
+            /* New files start out inline, with no data block at all. */
+            memset(&entry, 0, sizeof(struct sfs_entry));
+            strcpy(entry.filename, name);
+            entry.first_block = SFS_BLOCKIDX_END;
+            entry.size = SFS_INLINE;
+            if(img->flags & SFS_OPEN_COMPRESS){
+                entry.size |= SFS_COMPRESSED;
+            }
+
+            entry_write(img, &entry, dirOffset + i * sizeof(struct sfs_entry));
+
+            if(ret_file != NULL){
+                return file_open(img, dirOffset + i * sizeof(struct sfs_entry), O_RDWR, ret_file);
+            }
+            return 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+
+/*
+ * Shrink or grow the file at `path` to `size` bytes.
+ * Excess bytes are thrown away, whereas any bytes added in the process should
+ * be nil (\0).
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_truncate(struct sfs_image *img, const char *path, off_t size)
+{
+    log("truncate %s size=%ld\n", path, size);
+
+    struct sfs_entry entry;
+    unsigned entryOffset;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset) != 0){
+        return -ENOENT;
+    }
+
+    if(entry.size & SFS_DIRECTORY){
+        return -EISDIR;
+    }
+    if(size < 0){
+        return -EINVAL;
+    }
+    if((size_t)size > (size_t)SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE){
+        return -EFBIG;
+    }
+
+    int res = wb_sync(img, entryOffset);
+    if(res < 0){
+        return res;
+    }
+    disk_read(img, &entry, sizeof(struct sfs_entry), entryOffset);
+
+    return file_truncate(img, &entry, entryOffset, size);
+}
+
+
+/*
+ * Write contents of `buf` (of `size` bytes) to the file at `path`.
+ * The file is grown if nessecary, and any bytes already present are overwritten
+ * (whereas any other data is left intact). The `offset` argument specifies how
+ * many bytes should be skipped in the file, after which `size` bytes from
+ * buffer are written.
+ * This means that the new file size will be max(old_size, offset + size).
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write(struct sfs_image *img, const char *path, const char *buf,
+                     size_t size, off_t offset)
+{
+    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int)size, buf,
+        size, offset);
+
+    struct sfs_entry entry;
+    unsigned entryOffset;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset) != 0){
+        return -ENOENT;
+    }
+
+    if(entry.size & SFS_DIRECTORY){
+        return -EISDIR;
+    }
+
+    /* Buffered writes go first, or they would later overwrite this one. */
+    int res = wb_sync(img, entryOffset);
+    if(res < 0){
+        return res;
+    }
+    disk_read(img, &entry, sizeof(struct sfs_entry), entryOffset);
+
+    return file_write(img, &entry, entryOffset, buf, size, offset);
+}
+
+
+/*
+ * Open the file at `path`. Writes through the returned handle are buffered
+ * (see wb_write()).
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_open(struct sfs_image *img, const char *path, int flags,
+                    struct sfs_file **ret_file)
+{
+    log("open %s\n", path);
+
+    struct sfs_entry entry;
+    unsigned entryOffset;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset) != 0){
+        return -ENOENT;
+    }
+    if(entry.size & SFS_DIRECTORY){
+        return -EISDIR;
+    }
+
+    return file_open(img, entryOffset, flags, ret_file);
+}
+
+
+/*
+ * Read from an open file. Its entry is read straight from where the handle
+ * points, without looking up the path again.
+ * Returns the number of bytes read, or < 0 on error.
+ */
+static int file_pread(struct sfs_file *file, char *buf, size_t size, off_t offset)
+{
+    struct sfs_image *img = file->img;
+    struct sfs_entry entry;
+    unsigned entryOffset = file->entry_off;
+
+    /* Buffered writes go to disk first, so we read them back. A file opened
+     * read-only may still share the file with writers. */
+    struct wbuf *wb = file->wb;
+    if(wb == NULL){
+        wb = wb_find(img, entryOffset);
+    }
+    else {
+        entryOffset = wb->entry_off;
+    }
+    if(entryOffset == 0){
+        return -ENOENT;
+    }
+    if(wb != NULL){
+        int res = wb_flush(img, wb);
+        if(res < 0){
+            return res;
+        }
+    }
+
+    disk_read(img, &entry, sizeof(struct sfs_entry), entryOffset);
+    return file_read(img, &entry, buf, size, offset);
+}
+
+static int file_pwrite(struct sfs_file *file, const char *buf, size_t size,
+                       off_t offset)
+{
+    if(file->wb == NULL){
+        return -EBADF;
+    }
+    return wb_write(file->img, file->wb, buf, size, offset);
+}
+
+
+/*
+ * Write out buffered data and drop the handle. The buffer itself goes once
+ * the last handle to the file is closed.
+ */
+static int file_close(struct sfs_file *file)
+{
+    struct wbuf *wb = file->wb;
+    int res = 0;
+
+    if(wb == NULL){
+        if(file->prev){
+            file->prev->next = file->next;
+        }
+        else {
+            file->img->ro_files = file->next;
+        }
+        if(file->next){
+            file->next->prev = file->prev;
+        }
+    }
+    else {
+        res = wb_flush(file->img, wb);
+        if(--wb->nopen == 0){
+            free(wb->data);
+            wb->data = NULL;
+            wb->cap = 0;
+        }
+    }
+
+    free(file);
+    return res;
+}
+
+
+/*
+ * Turn compression on or off for the file at `path`, rewriting its contents in
+ * the new layout.
+ * Returns 0 on success, < 0 on error.
+ */
+static int set_compression(struct sfs_image *img, const char *path,
+                           int compress)
+{
+    struct sfs_entry entry;
+    unsigned entryOffset;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, &entryOffset) != 0){
+        return -ENOENT;
+    }
+    if(entry.size & SFS_DIRECTORY){
+        return -EISDIR;
+    }
+
+    int res = wb_sync(img, entryOffset);
+    if(res < 0){
+        return res;
+    }
+    disk_read(img, &entry, sizeof(struct sfs_entry), entryOffset);
+
+    if(!!(entry.size & SFS_COMPRESSED) == compress){
+        return 0;
+    }
+
+    /* Inline files keep their data where it is; the flag applies once they
+     * are promoted to blocks. */
+    if(entry.size & SFS_INLINE){
+        entry.size ^= SFS_COMPRESSED;
+        entry_write(img, &entry, entryOffset);
+        return 0;
+    }
+
+    size_t fileSize = SFS_FILESIZE(&entry);
+    char *data = malloc(fileSize ? fileSize : 1);
+    if(data == NULL){
+        return -ENOMEM;
+    }
+
+    /* The new layout is built on the side, and the old chain only dropped
+     * once the entry points at the new one. On error the file is left as it
+     * was. */
+    struct sfs_entry newEntry = entry;
+    newEntry.first_block = SFS_BLOCKIDX_END;
+    newEntry.size = compress ? SFS_COMPRESSED : 0;
+
+    res = file_read(img, &entry, data, fileSize, 0);
+    if(res >= 0){
+        res = fileSize > 0 ? file_write_data(img, &newEntry, data, fileSize, 0) : 0;
+    }
+    free(data);
+
+    if(res < 0){
+        if(newEntry.first_block != SFS_BLOCKIDX_END){
+            chain_put(img, newEntry.first_block);
+        }
+        return res;
+    }
+
+    newEntry.size |= fileSize;
+    entry_write(img, &newEntry, entryOffset);
+
+    if(entry.first_block != SFS_BLOCKIDX_EMPTY){
+        chain_release(img, entry.first_block, fileSize / SFS_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+
+/*
+ * Return whether the file at `path` is compressed.
+ */
+static int get_compression(struct sfs_image *img, const char *path)
+{
+    struct sfs_entry entry;
+
+    if(get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &entry, NULL) != 0){
+        return -ENOENT;
+    }
+
+    return !!(entry.size & SFS_COMPRESSED);
+}
+
+
+/*
+ * Clone the file at `srcPath` into the (existing) file at `path`. The clone
+ * shares the block chain of the source, so this takes constant time
+ * regardless of the file size. Shared blocks are copied on the first write to
+ * them (see block_unshare()). Any previous contents of `path` are dropped.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_clone(struct sfs_image *img, const char *srcPath,
+                      const char *path)
+{
+    log("clone %s %s\n", srcPath, path);
+
+    struct sfs_entry src, dst;
+    unsigned srcOffset, dstOffset;
+
+    if(get_entry_rec(img, srcPath, NULL, SFS_ROOTDIR_NENTRIES, 0, &src, &srcOffset) != 0 ||
+       get_entry_rec(img, path, NULL, SFS_ROOTDIR_NENTRIES, 0, &dst, &dstOffset) != 0){
+        return -ENOENT;
+    }
+
+    if((src.size & SFS_DIRECTORY) || (dst.size & SFS_DIRECTORY)){
+        return -EISDIR;
+    }
+
+    if(srcOffset == dstOffset){
+        return 0;
+    }
+
+    int res = wb_sync(img, srcOffset);
+    if(res == 0){
+        res = wb_sync(img, dstOffset);
+    }
+    if(res < 0){
+        return res;
+    }
+    disk_read(img, &src, sizeof(struct sfs_entry), srcOffset);
+    disk_read(img, &dst, sizeof(struct sfs_entry), dstOffset);
+
+    /* The old chain of dst is only dropped once the entry on disk no longer
+     * points at it, as in sfs_unlink. */
+    blockidx_t oldBlock = SFS_BLOCKIDX_END;
+    if(!(dst.size & SFS_INLINE) && dst.first_block != SFS_BLOCKIDX_EMPTY){
+        oldBlock = dst.first_block;
+    }
+
+    memset(inline_data(&dst), 0, inline_capacity(&dst));
+    dst.first_block = SFS_BLOCKIDX_END;
+    dst.size = SFS_INLINE;
+
+    if(src.size & SFS_INLINE){
+        /* Nothing to share, just copy the few bytes over. */
+        entry_write(img, &dst, dstOffset);
+        if(oldBlock != SFS_BLOCKIDX_END){
+            chain_put(img, oldBlock);
+        }
+        res = file_write(img, &dst, dstOffset, inline_data(&src), SFS_FILESIZE(&src), 0);
+        return res < 0 ? res : 0;
+    }
+
+    dst.first_block = src.first_block;
+    dst.size = src.size;
+    if(src.first_block != SFS_BLOCKIDX_EMPTY && src.first_block != SFS_BLOCKIDX_END){
+        img->refcnt[src.first_block]++;
+    }
+
+    entry_write(img, &dst, dstOffset);
+    if(oldBlock != SFS_BLOCKIDX_END){
+        chain_put(img, oldBlock);
+    }
+    return 0;
+}
+
+
+/*
+ * Report filesystem usage. Blocks shared between clones are counted once.
+ */
+static int sfs_statfs(struct sfs_image *img, struct statvfs *st)
+{
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = SFS_BLOCK_SIZE;
+    st->f_frsize = SFS_BLOCK_SIZE;
+    st->f_blocks = SFS_BLOCKTBL_NENTRIES;
+    st->f_namemax = 57;
+
+    for(unsigned int i=0; i<SFS_BLOCKTBL_NENTRIES; i++){
+        if(blocktbl_get(img, i) == SFS_BLOCKIDX_EMPTY){
+            st->f_bfree++;
+        }
+    }
+    st->f_bavail = st->f_bfree;
+
+    return 0;
+}
+
+
+/*
+ * Defragmentation: files whose chain is split over several runs of blocks are
+ * moved, one at a time, into the first free run that can hold the whole chain.
+ * The data is copied and the new run is linked up in the block table first;
+ * only then is first_block of the entry switched over, which is a single
+ * write, and the old blocks are freed. Chains shared between clones are left
+ * alone so that the sharing is not lost. Directories always occupy two
+ * adjacent blocks, so they never need moving.
+ *
+ * The copy is done DEFRAG_BATCH blocks at a time, and the lock is dropped in
+ * between so other operations are not held up by a large file. The background
+ * defragmenter also waits until the filesystem has been idle for
+ * DEFRAG_IDLE_MS before each batch. If the file is changed in the meantime,
+ * the move is abandoned and tried again later.
+ */
+#define DEFRAG_BATCH        64
+#define DEFRAG_IDLE_MS      500
+#define DEFRAG_INTERVAL_MS  100
+#define DEFRAG_BACKOFF_MS   5000
+
+static long ms_since(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/*
+ * Wait (with the lock held) for at most `ms` milliseconds, or until
+ * sfs_close_image() wakes us up.
+ */
+static void defrag_wait(struct sfs_image *img, long ms)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&img->defrag_cond, &img->lock, &until);
+}
+
+/*
+ * Let other operations in between two batches of a move.
+ * Returns 0 to go on, or -EAGAIN if the image is being closed.
+ */
+static int defrag_yield(struct sfs_image *img, int background)
+{
+    blocktbl_flush(img);
+    pthread_mutex_unlock(&img->lock);
+    sched_yield();
+    pthread_mutex_lock(&img->lock);
+
+    while (background && !img->defrag_stop &&
+           ms_since(&img->last_op) < DEFRAG_IDLE_MS)
+        defrag_wait(img, DEFRAG_INTERVAL_MS);
+
+    return img->defrag_stop ? -EAGAIN : 0;
+}
+
+static void chain_stats(struct sfs_image *img, blockidx_t blockidx,
+                        struct sfs_frag_stats *stats)
+{
+    blockidx_t prev = SFS_BLOCKIDX_END;
+
+    for (; blockidx != SFS_BLOCKIDX_END && blockidx < SFS_BLOCKTBL_NENTRIES;
+         blockidx = blocktbl_get(img, blockidx)) {
+        if (prev == SFS_BLOCKIDX_END || blockidx != prev + 1)
+            stats->runs++;
+        stats->blocks++;
+        prev = blockidx;
+    }
+}
+
+/*
+ * Return the first block of a free run of `n` blocks, or SFS_BLOCKIDX_END if
+ * there is none.
+ */
+static blockidx_t find_free_run(struct sfs_image *img, unsigned n)
+{
+    unsigned runLength = 0;
+
+    for (unsigned int i = 1; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        runLength = blocktbl_get(img, i) == SFS_BLOCKIDX_EMPTY ? runLength + 1 : 0;
+        if (runLength == n)
+            return i - n + 1;
+    }
+
+    return SFS_BLOCKIDX_END;
+}
+
+/*
+ * Move the chain of `entry` into a contiguous run if it is fragmented. The
+ * lock is dropped between batches, after which `entry` may be stale.
+ * Returns 1 if the file was moved, 0 if there was nothing to do, or -EAGAIN if
+ * the move was abandoned.
+ */
+static int defrag_entry(struct sfs_image *img, struct sfs_entry *entry,
+                        unsigned entry_off, int background)
+{
+    struct sfs_frag_stats stats = { 0, 0 };
+    int res = 0;
+
+    chain_stats(img, entry->first_block, &stats);
+    if (stats.runs <= 1)
+        return 0;
+
+    for (blockidx_t b = entry->first_block; b != SFS_BLOCKIDX_END; b = blocktbl_get(img, b)) {
+        if (img->refcnt[b] > 1)
+            return 0;
+    }
+
+    blockidx_t start = find_free_run(img, stats.blocks);
+    if (start == SFS_BLOCKIDX_END)
+        return 0;
+
+    log("defrag %s: %lu blocks in %lu runs -> %x\n", entry->filename,
+        stats.blocks, stats.runs, start);
+
+    /* Link up the new run right away, so nothing else allocates from it
+     * while the lock is dropped. */
+    for (unsigned long i = 0; i < stats.blocks; i++) {
+        blocktbl_set(img, start + i, i + 1 < stats.blocks ? start + i + 1 : SFS_BLOCKIDX_END);
+        img->refcnt[start + i] = 1;
+    }
+    img->defrag_off = entry_off;
+    img->defrag_abort = 0;
+
+    char data[DEFRAG_BATCH * SFS_BLOCK_SIZE];
+    blockidx_t old = entry->first_block;
+    blockidx_t b = old;
+
+    for (unsigned long done = 0; done < stats.blocks;) {
+        unsigned long n = stats.blocks - done < DEFRAG_BATCH ? stats.blocks - done : DEFRAG_BATCH;
+
+        for (unsigned long i = 0; i < n; i++, b = blocktbl_get(img, b))
+            disk_read(img, data + i * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE, SFS_DATA_OFF + b * SFS_BLOCK_SIZE);
+        disk_write(img, data, n * SFS_BLOCK_SIZE, SFS_DATA_OFF + (start + done) * SFS_BLOCK_SIZE);
+        done += n;
+
+        if (done < stats.blocks) {
+            res = defrag_yield(img, background);
+            /* A pack replaced the whole block table, new run included. */
+            if (img->defrag_off == 0)
+                return -EAGAIN;
+            if (res < 0 || img->defrag_abort || img->refcnt[old] > 1) {
+                res = -EAGAIN;
+                break;
+            }
+        }
+    }
+
+    img->defrag_off = 0;
+    if (res < 0) {
+        chain_put(img, start);
+        return res;
+    }
+
+    entry->first_block = start;
+    blocktbl_flush(img);
+    disk_write(img, &entry->first_block, sizeof(blockidx_t),
+               entry_off + offsetof(struct sfs_entry, first_block));
+    chain_put(img, old);
+
+    return 1;
+}
+
+/*
+ * Walk the directory tree. If `stats` is given, add up the fragmentation of all
+ * chains; otherwise defragment the first file that can be improved.
+ * Returns 1 if a file was moved, 0 if there was none to move, or -EAGAIN if a
+ * move was abandoned (see defrag_entry()).
+ */
+static int defrag_dir(struct sfs_image *img, off_t dir_off, unsigned n_entries,
+                      struct sfs_frag_stats *stats, int background)
+{
+    int res;
+
+    struct sfs_entry dir[n_entries];
+    disk_read(img, dir, n_entries * sizeof(struct sfs_entry), dir_off);
+
+    for (unsigned int i = 0; i < n_entries; i++) {
+        struct sfs_entry *entry = &dir[i];
+
+        if (strlen(entry->filename) < 1 || (entry->size & SFS_INLINE))
+            continue;
+
+        if (entry->size & SFS_DIRECTORY) {
+            if (stats)
+                chain_stats(img, entry->first_block, stats);
+            res = defrag_dir(img, SFS_DATA_OFF + entry->first_block * SFS_BLOCK_SIZE,
+                             SFS_DIR_NENTRIES, stats, background);
+            if (res != 0)
+                return res;
+        }
+        else if (SFS_FILESIZE(entry) > 0) {
+            if (stats)
+                chain_stats(img, entry->first_block, stats);
+            else if ((res = defrag_entry(img, entry, dir_off + i * sizeof(struct sfs_entry),
+                                         background)) != 0)
+                return res;
+        }
+    }
+
+    return 0;
+}
+
+static int frag_stats(struct sfs_image *img, struct sfs_frag_stats *stats)
+{
+    stats->blocks = 0;
+    stats->runs = 0;
+    defrag_dir(img, SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES, stats, 0);
+    return 0;
+}
+
+
+/*
+ * sfs_pack: build an image straight from a directory tree on the host, instead
+ * of copying files in one at a time through a mount. The layout is planned in
+ * memory first: every directory gets two adjacent blocks, every file a
+ * contiguous run following the previous one, and tiny files are stored inline.
+ * The contents of the files are then read by a pool of threads directly into
+ * an in-memory copy of the data region, which is written out in one go along
+ * with the root directory and the block table. The superblock of the image is
+ * left alone, so the target must already be a formatted SFS image; its old
+ * contents are replaced.
+ */
+#define PACK_MAX_THREADS    8
+
+struct pack_job {
+    char *hostpath;
+    size_t size;
+    blockidx_t first_block;
+};
+
+struct pack {
+    struct sfs_image *img;
+    char *data;             /* In-memory copy of the data region */
+    blockidx_t *blocktbl;   /* The new block table and reference counts, */
+    uint16_t *refcnt;       /* installed in img only once packing succeeded */
+    unsigned nblocks;       /* Blocks handed out so far */
+    struct pack_job *jobs;
+    unsigned njobs;
+    unsigned maxjobs;
+    unsigned nextjob;
+    int error;
+};
+
+static int pack_alloc(struct pack *pack, unsigned n, blockidx_t *ret_blockidx)
+{
+    if (pack->nblocks + n > SFS_BLOCKTBL_NENTRIES)
+        return -ENOSPC;
+
+    *ret_blockidx = pack->nblocks;
+    for (unsigned int i = 0; i < n; i++) {
+        pack->blocktbl[pack->nblocks + i] = i + 1 < n ? pack->nblocks + i + 1 : SFS_BLOCKIDX_END;
+        pack->refcnt[pack->nblocks + i] = 1;
+    }
+    pack->nblocks += n;
+
+    return 0;
+}
+
+static int pack_read(const char *hostpath, char *buf, size_t size)
+{
+    int fd = open(hostpath, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = pread(fd, buf + done, size - done, done);
+        if (n <= 0) {
+            close(fd);
+            return n < 0 ? -errno : -EIO;
+        }
+        done += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void *pack_worker(void *arg)
+{
+    struct pack *pack = arg;
+    unsigned j;
+
+    while ((j = __atomic_fetch_add(&pack->nextjob, 1, __ATOMIC_RELAXED)) < pack->njobs) {
+        struct pack_job *job = &pack->jobs[j];
+        int res = pack_read(job->hostpath,
+                            pack->data + job->first_block * SFS_BLOCK_SIZE, job->size);
+        if (res < 0) {
+            fprintf(stderr, "%s: %s\n", job->hostpath, strerror(-res));
+            pack->error = res;
+        }
+    }
+
+    return NULL;
+}
+
+static void pack_empty_dir(struct sfs_entry *dir, unsigned n_entries)
+{
+    memset(dir, 0, n_entries * sizeof(struct sfs_entry));
+    for (unsigned int i = 0; i < n_entries; i++)
+        dir[i].first_block = SFS_BLOCKIDX_EMPTY;
+}
+
+/*
+ * Lay out the contents of host directory `hostdir` into `dir`. Files are only
+ * queued up as jobs here; their data is read later by pack_worker().
+ * Returns 0 on success, < 0 on error.
+ */
+static int pack_dir(struct pack *pack, const char *hostdir,
+                    struct sfs_entry *dir, unsigned n_entries)
+{
+    DIR *d = opendir(hostdir);
+    struct dirent *de;
+    unsigned int i = 0;
+    int res = 0;
+
+    if (d == NULL) {
+        fprintf(stderr, "%s: %s\n", hostdir, strerror(errno));
+        return -errno;
+    }
+
+    while (res == 0 && (de = readdir(d)) != NULL) {
+        char hostpath[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        snprintf(hostpath, sizeof(hostpath), "%s/%s", hostdir, de->d_name);
+        if (lstat(hostpath, &st) < 0) {
+            res = -errno;
+            fprintf(stderr, "%s: %s\n", hostpath, strerror(errno));
+            break;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "%s: skipping, not a file or directory\n", hostpath);
+            continue;
+        }
+        if (i == n_entries) {
+            res = -ENOSPC;
+            fprintf(stderr, "%s: more than %u entries\n", hostdir, n_entries);
+            break;
+        }
+        if (strlen(de->d_name) >= 58) {
+            res = -ENAMETOOLONG;
+            fprintf(stderr, "%s: name too long\n", hostpath);
+            break;
+        }
+
+        struct sfs_entry *entry = &dir[i++];
+        strcpy(entry->filename, de->d_name);
+
+        if (S_ISDIR(st.st_mode)) {
+            entry->size = SFS_DIRECTORY;
+            res = pack_alloc(pack, 2, &entry->first_block);
+            if (res < 0)
+                fprintf(stderr, "%s: image full\n", hostpath);
+            else {
+                struct sfs_entry *subdir =
+                    (struct sfs_entry *)(pack->data + entry->first_block * SFS_BLOCK_SIZE);
+                pack_empty_dir(subdir, SFS_DIR_NENTRIES);
+                res = pack_dir(pack, hostpath, subdir, SFS_DIR_NENTRIES);
+            }
+        }
+        else if ((size_t)st.st_size <= inline_capacity(entry)) {
+            entry->first_block = SFS_BLOCKIDX_END;
+            entry->size = SFS_INLINE | st.st_size;
+            res = pack_read(hostpath, inline_data(entry), st.st_size);
+            if (res < 0)
+                fprintf(stderr, "%s: %s\n", hostpath, strerror(-res));
+        }
+        else {
+            entry->size = st.st_size;
+            res = pack_alloc(pack, (st.st_size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE,
+                             &entry->first_block);
+            if (res < 0)
+                fprintf(stderr, "%s: image full\n", hostpath);
+            else {
+                if (pack->njobs == pack->maxjobs) {
+                    pack->maxjobs = pack->maxjobs ? pack->maxjobs * 2 : 64;
+                    pack->jobs = realloc(pack->jobs, pack->maxjobs * sizeof(struct pack_job));
+                }
+                pack->jobs[pack->njobs].hostpath = strdup(hostpath);
+                pack->jobs[pack->njobs].size = st.st_size;
+                pack->jobs[pack->njobs].first_block = entry->first_block;
+                pack->njobs++;
+            }
+        }
+    }
+
+    closedir(d);
+    return res;
+}
+
+static int pack_image(struct sfs_image *img, const char *hostdir)
+{
+    struct pack pack = { .img = img };
+    struct sfs_entry rootdir[SFS_ROOTDIR_NENTRIES];
+    pthread_t threads[PACK_MAX_THREADS];
+    int res;
+
+    /* The image is left alone until everything has been read, so a failed
+     * pack does not lose its old contents. */
+    pack.data = calloc(SFS_BLOCKTBL_NENTRIES, SFS_BLOCK_SIZE);
+    pack.blocktbl = malloc(sizeof(img->blocktbl));
+    pack.refcnt = calloc(1, sizeof(img->refcnt));
+    if (pack.data == NULL || pack.blocktbl == NULL || pack.refcnt == NULL) {
+        free(pack.data);
+        free(pack.blocktbl);
+        free(pack.refcnt);
+        return -ENOMEM;
+    }
+
+    pack.nblocks = 1;   /* Block 0 is never used, see alloc_block() */
+    for (unsigned int i = 0; i < SFS_BLOCKTBL_NENTRIES; i++)
+        pack.blocktbl[i] = SFS_BLOCKIDX_EMPTY;
+    pack_empty_dir(rootdir, SFS_ROOTDIR_NENTRIES);
+
+    res = pack_dir(&pack, hostdir, rootdir, SFS_ROOTDIR_NENTRIES);
+
+    if (res == 0) {
+        long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+        if (nthreads > PACK_MAX_THREADS)
+            nthreads = PACK_MAX_THREADS;
+
+        for (long i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, pack_worker, &pack);
+        for (long i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        res = pack.error;
+    }
+
+    if (res == 0) {
+        disk_write(img, rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+        disk_write(img, pack.blocktbl, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+        disk_write(img, pack.data, pack.nblocks * SFS_BLOCK_SIZE, SFS_DATA_OFF);
+
+        /* Everything on the image is replaced: open files lose their file,
+         * and chains waiting to be reclaimed or moved are gone with the old
+         * block table. */
+        memcpy(img->blocktbl, pack.blocktbl, sizeof(img->blocktbl));
+        memcpy(img->refcnt, pack.refcnt, sizeof(img->refcnt));
+        memset(img->blocktbl_dirty, 0, sizeof(img->blocktbl_dirty));
+        memset(img->ccache, 0, sizeof(img->ccache));
+        memset(img->cluster_nblocks, 0, sizeof(img->cluster_nblocks));
+        img->chain_gen++;
+        file_forget(img, 0);
+        img->reclaim_count = 0;
+        img->defrag_off = 0;
+
+        log("packed %s: %u files in blocks, %u blocks used\n",
+            hostdir, pack.njobs, pack.nblocks);
+    }
+
+    for (unsigned int i = 0; i < pack.njobs; i++)
+        free(pack.jobs[i].hostpath);
+    free(pack.jobs);
+    free(pack.data);
+    free(pack.blocktbl);
+    free(pack.refcnt);
+
+    return res;
+}
+
+
+/*
+ * sfs_unpack: extract the whole image into a directory on the host.
+ * Returns 0 on success, < 0 on error.
+ */
+static int unpack_dir(struct sfs_image *img, const char *hostdir, off_t dir_off,
+                      unsigned n_entries)
+{
+    struct sfs_entry dir[n_entries];
+
+    if (mkdir(hostdir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: %s\n", hostdir, strerror(errno));
+        return -errno;
+    }
+
+    disk_read(img, dir, n_entries * sizeof(struct sfs_entry), dir_off);
+
+    for (unsigned int i = 0; i < n_entries; i++) {
+        char hostpath[PATH_MAX];
+        int res = 0;
+
+        if (strlen(dir[i].filename) < 1)
+            continue;
+
+        /* The image may be corrupt or made to escape hostdir */
+        if (!strcmp(dir[i].filename, ".") || !strcmp(dir[i].filename, "..") ||
+            strchr(dir[i].filename, '/')) {
+            fprintf(stderr, "%s: invalid file name \"%s\"\n", hostdir, dir[i].filename);
+            return -EINVAL;
+        }
+
+        snprintf(hostpath, sizeof(hostpath), "%s/%s", hostdir, dir[i].filename);
+
+        if (dir[i].size & SFS_DIRECTORY) {
+            res = unpack_dir(img, hostpath, SFS_DATA_OFF + dir[i].first_block * SFS_BLOCK_SIZE,
+                             SFS_DIR_NENTRIES);
+        }
+        else {
+            size_t fileSize = SFS_FILESIZE(&dir[i]);
+            char *data = malloc(fileSize ? fileSize : 1);
+            int fd;
+
+            res = file_read(img, &dir[i], data, fileSize, 0);
+            if (res >= 0 && (fd = open(hostpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+                res = write(fd, data, fileSize) == (ssize_t)fileSize ? 0 : -EIO;
+                close(fd);
+            }
+            else if (res >= 0) {
+                res = -errno;
+            }
+            free(data);
+
+            if (res < 0)
+                fprintf(stderr, "%s: %s\n", hostpath, strerror(-res));
+        }
+
+        if (res < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+/*
+ * The functions making up the public interface take the lock of the image, and
+ * write back the block table before returning.
+ */
+static void image_lock(struct sfs_image *img)
+{
+    pthread_mutex_lock(&img->lock);
+    if (img->lock_hook)
+        img->lock_hook(img->lock_hook_arg);
+}
+
+static void image_unlock(struct sfs_image *img)
+{
+    blocktbl_flush(img);
+    clock_gettime(CLOCK_MONOTONIC, &img->last_op);
+    pthread_mutex_unlock(&img->lock);
+}
+
+#define LOCKED(name, impl, params, args)            \
+    int name params                                 \
+    {                                               \
+        image_lock(img);                            \
+        int res = impl args;                        \
+        image_unlock(img);                          \
+        return res;                                 \
+    }
+
+LOCKED(sfs_path_stat, sfs_getattr,
+       (struct sfs_image *img, const char *path, struct stat *st),
+       (img, path, st))
+LOCKED(sfs_dir_list, sfs_readdir,
+       (struct sfs_image *img, const char *path, sfs_dir_filler filler, void *arg),
+       (img, path, arg, filler))
+LOCKED(sfs_dir_create, sfs_mkdir,
+       (struct sfs_image *img, const char *path),
+       (img, path))
+LOCKED(sfs_dir_remove, sfs_rmdir,
+       (struct sfs_image *img, const char *path),
+       (img, path))
+LOCKED(sfs_file_read, sfs_read,
+       (struct sfs_image *img, const char *path, char *buf, size_t size,
+        off_t offset),
+       (img, path, buf, size, offset))
+LOCKED(sfs_file_write, sfs_write,
+       (struct sfs_image *img, const char *path, const char *buf, size_t size,
+        off_t offset),
+       (img, path, buf, size, offset))
+LOCKED(sfs_file_truncate, sfs_truncate,
+       (struct sfs_image *img, const char *path, off_t size),
+       (img, path, size))
+LOCKED(sfs_file_unlink, sfs_unlink,
+       (struct sfs_image *img, const char *path),
+       (img, path))
+LOCKED(sfs_file_clone, file_clone,
+       (struct sfs_image *img, const char *src, const char *dst),
+       (img, src, dst))
+LOCKED(sfs_file_get_compression, get_compression,
+       (struct sfs_image *img, const char *path),
+       (img, path))
+LOCKED(sfs_file_set_compression, set_compression,
+       (struct sfs_image *img, const char *path, int compress),
+       (img, path, compress))
+LOCKED(sfs_file_open, sfs_open,
+       (struct sfs_image *img, const char *path, int flags,
+        struct sfs_file **ret_file),
+       (img, path, flags, ret_file))
+LOCKED(sfs_file_create, sfs_create,
+       (struct sfs_image *img, const char *path, struct sfs_file **ret_file),
+       (img, path, ret_file))
+LOCKED(sfs_image_sync, wb_flush_all,
+       (struct sfs_image *img),
+       (img))
+LOCKED(sfs_image_statfs, sfs_statfs,
+       (struct sfs_image *img, struct statvfs *st),
+       (img, st))
+LOCKED(sfs_image_frag_stats, frag_stats,
+       (struct sfs_image *img, struct sfs_frag_stats *stats),
+       (img, stats))
+LOCKED(sfs_image_pack, pack_image,
+       (struct sfs_image *img, const char *hostdir),
+       (img, hostdir))
+LOCKED(sfs_image_unpack, unpack_dir,
+       (struct sfs_image *img, const char *hostdir),
+       (img, hostdir, SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES))
+
+int sfs_file_pread(struct sfs_file *file, char *buf, size_t size, off_t offset)
+{
+    struct sfs_image *img = file->img;
+
+    image_lock(img);
+    int res = file_pread(file, buf, size, offset);
+    image_unlock(img);
+    return res;
+}
+
+int sfs_file_pwrite(struct sfs_file *file, const char *buf, size_t size,
+                    off_t offset)
+{
+    struct sfs_image *img = file->img;
+
+    image_lock(img);
+    int res = file_pwrite(file, buf, size, offset);
+    image_unlock(img);
+    return res;
+}
+
+int sfs_file_sync(struct sfs_file *file)
+{
+    struct sfs_image *img = file->img;
+
+    image_lock(img);
+    int res = file->wb ? wb_flush(img, file->wb) : 0;
+    image_unlock(img);
+    return res;
+}
+
+int sfs_file_close(struct sfs_file *file)
+{
+    struct sfs_image *img = file->img;
+
+    image_lock(img);
+    int res = file_close(file);
+    image_unlock(img);
+    return res;
+}
+
+/*
+ * Defragment file by file, letting other operations in between.
+ */
+int sfs_image_defrag(struct sfs_image *img)
+{
+    int moved = 0;
+
+    for (;;) {
+        image_lock(img);
+        int res = defrag_dir(img, SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES, NULL, 0);
+        image_unlock(img);
+
+        if (res == 0)
+            return moved;
+        if (res > 0)
+            moved++;
+    }
+}
+
+
+/*
+ * Background defragmenter, enabled with SFS_OPEN_AUTODEFRAG. It runs at the
+ * lowest scheduling priority, and only starts moving a file once no operation
+ * has come in for DEFRAG_IDLE_MS. It backs off for longer when there was
+ * nothing left to do. sfs_close_image() wakes it up to stop.
+ */
+static void *defrag_thread(void *arg)
+{
+    struct sfs_image *img = arg;
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    pthread_mutex_lock(&img->lock);
+
+    while (!img->defrag_stop) {
+        int res = -EAGAIN;
+
+        if (ms_since(&img->last_op) >= DEFRAG_IDLE_MS)
+            res = defrag_dir(img, SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES, NULL, 1);
+        blocktbl_flush(img);
+
+        if (!img->defrag_stop)
+            defrag_wait(img, res != 0 ? DEFRAG_INTERVAL_MS : DEFRAG_BACKOFF_MS);
+    }
+
+    pthread_mutex_unlock(&img->lock);
+    return NULL;
+}
+
+/*
+ * Background reclaimer for the chains queued by chain_release(). It frees
+ * RECLAIM_BATCH blocks at a time, letting other operations in between.
+ */
+static void *reclaim_thread(void *arg)
+{
+    struct sfs_image *img = arg;
+
+    pthread_mutex_lock(&img->lock);
+
+    while (!img->reclaim_stop) {
+        if (img->reclaim_count == 0) {
+            pthread_cond_wait(&img->reclaim_cond, &img->lock);
+            continue;
+        }
+
+        blockidx_t *blockidx = &img->reclaim_queue[img->reclaim_first];
+        *blockidx = chain_put_some(img, *blockidx, RECLAIM_BATCH);
+        if (*blockidx == SFS_BLOCKIDX_END) {
+            img->reclaim_first = (img->reclaim_first + 1) % RECLAIM_QUEUE_LEN;
+            img->reclaim_count--;
+        }
+        blocktbl_flush(img);
+
+        pthread_mutex_unlock(&img->lock);
+        sched_yield();
+        pthread_mutex_lock(&img->lock);
+    }
+
+    /* Finish up before closing the image, so nothing is left orphaned. */
+    for (; img->reclaim_count > 0; img->reclaim_count--) {
+        chain_put(img, img->reclaim_queue[img->reclaim_first]);
+        img->reclaim_first = (img->reclaim_first + 1) % RECLAIM_QUEUE_LEN;
+    }
+    img->reclaim_running = 0;
+    blocktbl_flush(img);
+
+    pthread_mutex_unlock(&img->lock);
+    return NULL;
+}
+
+
+struct sfs_image *sfs_open_image(const char *filename, int flags)
+{
+    struct sfs_image *img = calloc(1, sizeof(struct sfs_image));
+    struct stat st;
+
+    if (img == NULL)
+        return NULL;
+
+    img->fd = open(filename, O_RDWR);
+    if (img->fd < 0) {
+        free(img);
+        return NULL;
+    }
+    if (fstat(img->fd, &st) < 0 || (size_t)st.st_size < SFS_DATA_OFF) {
+        close(img->fd);
+        free(img);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    img->flags = flags;
+    pthread_mutex_init(&img->lock, NULL);
+    pthread_cond_init(&img->reclaim_cond, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&img->defrag_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    clock_gettime(CLOCK_MONOTONIC, &img->last_op);
+
+    blocktbl_load(img);
+    return img;
+}
+
+void sfs_image_set_lock_hook(struct sfs_image *img, void (*hook)(void *arg),
+                             void *arg)
+{
+    pthread_mutex_lock(&img->lock);
+    img->lock_hook = hook;
+    img->lock_hook_arg = arg;
+    pthread_mutex_unlock(&img->lock);
+}
+
+int sfs_image_start(struct sfs_image *img)
+{
+    int res = pthread_create(&img->reclaim_tid, NULL, reclaim_thread, img);
+    if (res != 0)
+        return -res;
+
+    image_lock(img);
+    img->reclaim_running = 1;
+    image_unlock(img);
+
+    if (img->flags & SFS_OPEN_AUTODEFRAG) {
+        res = pthread_create(&img->defrag_tid, NULL, defrag_thread, img);
+        if (res != 0)
+            return -res;
+        img->defrag_running = 1;
+    }
+
+    return 0;
+}
+
+int sfs_close_image(struct sfs_image *img)
+{
+    if (img->defrag_running) {
+        pthread_mutex_lock(&img->lock);
+        img->defrag_stop = 1;
+        pthread_cond_signal(&img->defrag_cond);
+        pthread_mutex_unlock(&img->lock);
+        pthread_join(img->defrag_tid, NULL);
+    }
+
+    image_lock(img);
+    int res = wb_flush_all(img);
+    image_unlock(img);
+
+    if (img->reclaim_running) {
+        pthread_mutex_lock(&img->lock);
+        img->reclaim_stop = 1;
+        pthread_cond_signal(&img->reclaim_cond);
+        pthread_mutex_unlock(&img->lock);
+        pthread_join(img->reclaim_tid, NULL);
+    }
+
+    for (unsigned int i = 0; i < WB_MAX_FILES; i++)
+        free(img->wbufs[i].data);
+    for (unsigned int i = 0; i < SFS_CINDEX_NSLOTS; i++)
+        free(img->cindex[i].heads);
+
+    if (close(img->fd) < 0 && res == 0)
+        res = -errno;
+
+    pthread_cond_destroy(&img->reclaim_cond);
+    pthread_cond_destroy(&img->defrag_cond);
+    pthread_mutex_destroy(&img->lock);
+    free(img);
+    return res;
+}
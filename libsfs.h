@@ -0,0 +1,139 @@
+#ifndef LIBSFS_H
+#define LIBSFS_H
+
+/*
+ * libsfs: read and modify SFS images from within a process, without going
+ * through a FUSE mount. The sfs daemon is a thin wrapper around this library.
+ *
+ * An image is opened with sfs_open_image(), which returns a handle that is
+ * passed to every other call. Files can be accessed by path, or opened to get
+ * a struct sfs_file handle, which skips the path lookup on every access and
+ * buffers writes until it is synced or closed.
+ *
+ * Unless noted otherwise, functions return 0 (or a number of bytes) on
+ * success, and a negative errno value on error. An image may be used from
+ * several threads at once; every call takes the lock of the image.
+ */
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+struct sfs_image;
+struct sfs_file;
+
+/* Flags for sfs_open_image() */
+#define SFS_OPEN_COMPRESS       0x1     /* Compress newly created files */
+#define SFS_OPEN_AUTODEFRAG     0x2     /* Defragment in the background when idle */
+
+/* Print debug information about every operation to stdout. */
+extern int sfs_verbose;
+
+/*
+ * Open the image in `filename`. Returns NULL and sets errno on error.
+ */
+struct sfs_image *sfs_open_image(const char *filename, int flags);
+
+/*
+ * Start the background threads of the image: the reclaimer that frees the
+ * blocks of large deleted files, and the defragmenter if SFS_OPEN_AUTODEFRAG
+ * was given. Without them large chains are simply freed right away. This is
+ * separate from sfs_open_image(), as threads do not survive a fork().
+ */
+int sfs_image_start(struct sfs_image *img);
+
+/*
+ * Have `hook` called at the start of every call on the image, with the lock
+ * of the image held, so calls from several threads see it in the order they
+ * run. The background threads do not call it. NULL removes the hook.
+ */
+void sfs_image_set_lock_hook(struct sfs_image *img, void (*hook)(void *arg),
+                             void *arg);
+
+/*
+ * Write out all buffered data, stop the background threads and close the
+ * image. Files still open must not be used after this.
+ */
+int sfs_close_image(struct sfs_image *img);
+
+int sfs_image_sync(struct sfs_image *img);
+int sfs_image_statfs(struct sfs_image *img, struct statvfs *st);
+
+struct sfs_frag_stats {
+    unsigned long blocks;
+    unsigned long runs;         /* Runs of adjacent blocks the chains consist of */
+};
+
+int sfs_image_frag_stats(struct sfs_image *img, struct sfs_frag_stats *stats);
+
+/*
+ * Defragment the whole image. Returns the number of files moved.
+ */
+int sfs_image_defrag(struct sfs_image *img);
+
+/*
+ * Replace the contents of the image with host directory `hostdir`, or extract
+ * the image into it. The image must not have any files open.
+ */
+int sfs_image_pack(struct sfs_image *img, const char *hostdir);
+int sfs_image_unpack(struct sfs_image *img, const char *hostdir);
+
+/*
+ * Called by sfs_dir_list() for every entry in the directory. A non-zero
+ * return value stops the listing.
+ */
+typedef int (*sfs_dir_filler)(void *arg, const char *name);
+
+int sfs_path_stat(struct sfs_image *img, const char *path, struct stat *st);
+int sfs_dir_list(struct sfs_image *img, const char *path,
+                 sfs_dir_filler filler, void *arg);
+int sfs_dir_create(struct sfs_image *img, const char *path);
+int sfs_dir_remove(struct sfs_image *img, const char *path);
+
+/*
+ * Path-based file access. Each call looks up `path`.
+ */
+int sfs_file_read(struct sfs_image *img, const char *path, char *buf,
+                  size_t size, off_t offset);
+int sfs_file_write(struct sfs_image *img, const char *path, const char *buf,
+                   size_t size, off_t offset);
+int sfs_file_truncate(struct sfs_image *img, const char *path, off_t size);
+int sfs_file_unlink(struct sfs_image *img, const char *path);
+
+/*
+ * Make `dst` (which must exist) a copy of `src`. The copy shares the blocks of
+ * the source until either is written to, so this takes constant time.
+ */
+int sfs_file_clone(struct sfs_image *img, const char *src, const char *dst);
+
+/*
+ * Return whether the file at `path` is compressed (0 or 1), or turn
+ * compression on or off, rewriting its contents.
+ */
+int sfs_file_get_compression(struct sfs_image *img, const char *path);
+int sfs_file_set_compression(struct sfs_image *img, const char *path, int compress);
+
+/*
+ * Open or create a file. `flags` takes the access mode (O_RDONLY, O_WRONLY or
+ * O_RDWR); sfs_file_create() always opens for reading and writing. If
+ * ret_file is NULL, sfs_file_create() only creates the file. At most 256
+ * different files can be open for writing at once (-ENFILE otherwise).
+ */
+int sfs_file_open(struct sfs_image *img, const char *path, int flags,
+                  struct sfs_file **ret_file);
+int sfs_file_create(struct sfs_image *img, const char *path,
+                    struct sfs_file **ret_file);
+
+/*
+ * Access an open file. Writes are collected in memory and reach the image on
+ * sfs_file_sync(), sfs_file_close(), or once enough has been buffered; reads
+ * see them either way.
+ */
+int sfs_file_pread(struct sfs_file *file, char *buf, size_t size, off_t offset);
+int sfs_file_pwrite(struct sfs_file *file, const char *buf, size_t size,
+                    off_t offset);
+int sfs_file_sync(struct sfs_file *file);
+int sfs_file_close(struct sfs_file *file);
+
+#endif /* LIBSFS_H */
@@ -1,19 +1,23 @@
 #define FUSE_USE_VERSION 26
 
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <libgen.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 #include <assert.h>
 
-#include "sfs.h"
-#include "diskio.h"
+#include "libsfs.h"
+#include "sfs_trace.h"
 
 
 static const char default_img[] = "test.img";
+static const unsigned default_trace_size = 64;
 
 /* Options passed from commandline arguments */
 struct options {
@@ -22,773 +26,220 @@ struct options {
     int verbose;
     int show_help;
     int show_fuse_help;
+    int compress;
+    int defrag;
+    int autodefrag;
+    const char *pack;
+    const char *unpack;
+    const char *trace;
+    unsigned trace_size;
 } options;
 
 
-#define log(fmt, ...) \
-    do { \
-        if (options.verbose) \
-            printf(" # " fmt, ##__VA_ARGS__); \
-    } while (0)
-
-
 /* libfuse2 leaks, so let's shush LeakSanitizer if we are using Asan. */
 const char* __asan_default_options() { return "detect_leaks=0"; }
 
 
 /*
- * This is a helper function that is optional, but highly recomended you
- * implement and use. Given a path, it looks it up on disk. It will return 0 on
- * success, and a non-zero value on error (e.g., the file did not exist).
- * The resulting directory entry is placed in the memory pointed to by
- * ret_entry. Additionally it can return the offset of that direntry on disk in
- * ret_entry_off, which you can use to update the entry and write it back to
- * disk (e.g., rmdir, unlink, truncate, write).
- *
- * You can start with implementing this function to work just for paths in the
- * root entry, and later modify it to also work for paths with subdirectories.
- * This way, all of your other functions can use this helper and will
- * automatically support subdirectories. To make this function support
- * subdirectories, we recommend you refactor this function to be recursive, and
- * take the current directory as argument as well. For example:
- *
- *  static int get_entry_rec(const char *path, const struct sfs_entry *parent,
- *                           size_t parent_nentries, blockidx_t parent_blockidx,
- *                           struct sfs_entry *ret_entry,
- *                           unsigned *ret_entry_off)
- *
- * Here parent is the directory it is currently searching (at first the rootdir,
- * later the subdir). The parent_nentries tells the function how many entries
- * there are in the directory (SFS_ROOTDIR_NENTRIES or SFS_DIR_NENTRIES).
- * Finally, the parent_blockidx contains the blockidx of the given directory on
- * the disk, which will help in calculating ret_entry_off.
+ * The FUSE callbacks below map straight onto libsfs, which does all the work
+ * (and the locking) on the image opened in main().
  */
-static int get_entry_rec(const char *path, const struct sfs_entry *parent,
-                            size_t parent_nentries, blockidx_t parent_blockidx,
-                            struct sfs_entry *ret_entry,
-                            unsigned *ret_entry_off)
-{
-    /* Get the next component of the path. Make sure to not modify path if it is
-     * the value passed by libfuse (i.e., make a copy). Note that strtok
-     * modifies the string you pass it. */
-
-    /* Allocate memory for the rootdir (and later, subdir) and read it from disk */
-
-    /* Loop over all entries in the directory, looking for one with the name
-     * equal to the current part of the path. If it is the last part of the
-     * path, return it. If there are more parts remaining, recurse to handle
-     * that subdirectory. */
-
-    // log("path in entry: %s",path);
-    
-    int res = 1;    
-    char pathCopy[100];    
-    void *lastDir = NULL;
-    const char slash[2] = "/";
-    
-    strcpy(pathCopy, path);
-    lastDir = strtok(pathCopy, slash);
-
-    if(lastDir != NULL){
-        void *temp = lastDir;
-
-        while(temp != NULL){
-            lastDir = temp;
-
-            if(strlen(lastDir) >= 58){
-               return -ENAMETOOLONG;
-            }
-            temp = strtok(NULL, slash);
-        }
+static struct sfs_image *img;
 
-        if(strlen(lastDir) >= 58){
-            return -ENAMETOOLONG;
-        }
-    }
+/* Open files keep their libsfs handle in fi->fh. */
+#define FI_FILE(fi) ((struct sfs_file *)(uintptr_t)(fi)->fh)
 
-    // log("last parent %s for %s", (char *)lastParent, (char *)lastDir);
-    
-
-    struct sfs_entry dir[parent_nentries];
-      
-    if(parent_nentries == SFS_ROOTDIR_NENTRIES){
-
-        disk_read(dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-        
-        for (unsigned int i=0; i < parent_nentries; i++){
-            if(strlen(dir[i].filename) > 0 && strcmp(dir[i].filename, lastDir) == 0){
-            
-                res = 0;
-                
-                if(ret_entry_off == NULL){
-                    log("isnull");
-                }
-                else {
-                    log("isnotnull");
-                    *ret_entry_off = SFS_ROOTDIR_OFF + i * sizeof(struct sfs_entry);
-                }
-
-                disk_read(ret_entry, sizeof(struct sfs_entry), SFS_ROOTDIR_OFF + i * sizeof(struct sfs_entry));
-                return res;   
-            }  
-        } 
-
-        strcpy(pathCopy, path);
-        void *childDir = strtok(pathCopy, slash);
-
-        if(childDir == NULL){
-            return 1;
-        }
 
-        for (unsigned int i=0; i < parent_nentries; i++){
-            if(strlen(dir[i].filename) > 0 && strcmp(dir[i].filename, childDir) == 0){
-                    
-                struct sfs_entry *newparent = &dir[i];
-                disk_read(ret_entry, sizeof(struct sfs_entry), SFS_ROOTDIR_OFF + i * sizeof(struct sfs_entry));
+static int sfs_getattr(const char *path, struct stat *st)
+{
+    return sfs_path_stat(img, path, st);
+}
 
-                res = get_entry_rec(path, newparent, SFS_DIR_NENTRIES, dir[i].first_block, ret_entry, ret_entry_off);
-                return res;
-            }
-        }
 
-        return 1;
-    }
-    else if (parent_nentries == SFS_DIR_NENTRIES) {
+struct readdir_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
 
-        disk_read(dir, SFS_DIR_SIZE, SFS_DATA_OFF + parent_blockidx * SFS_BLOCK_SIZE);
+static int readdir_fill(void *arg, const char *name)
+{
+    struct readdir_ctx *ctx = arg;
+    return ctx->filler(ctx->buf, name, NULL, 0);
+}
 
-        if(ret_entry_off == NULL){
-            log("isnull");
-        }
-        else {
-            log("isnotnull");
-            *ret_entry_off = SFS_DATA_OFF + parent_blockidx * SFS_BLOCK_SIZE;
-        }
-        
-        for(unsigned int i=0; i<parent_nentries; i++){
-            
-            if(strlen(dir[i].filename) > 0 && strcmp(dir[i].filename, lastDir) == 0 ){ // && strcmp(parent->filename, lastParent) == 0
+static int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       off_t offset, struct fuse_file_info *fi)
+{
+    (void)offset, (void)fi;
+    struct readdir_ctx ctx = { buf, filler };
 
-                res = 0;
+    return sfs_dir_list(img, path, readdir_fill, &ctx);
+}
 
-                
 
-                disk_read(ret_entry, sizeof(struct sfs_entry), SFS_DATA_OFF + i * sizeof(struct sfs_entry) + parent_blockidx * SFS_BLOCK_SIZE);
-                return res;
-            }
+static int sfs_read(const char *path, char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    if (fi != NULL && fi->fh != 0)
+        return sfs_file_pread(FI_FILE(fi), buf, size, offset);
+    return sfs_file_read(img, path, buf, size, offset);
+}
 
-        }
+static int sfs_write(const char *path, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi)
+{
+    if (fi != NULL && fi->fh != 0)
+        return sfs_file_pwrite(FI_FILE(fi), buf, size, offset);
+    return sfs_file_write(img, path, buf, size, offset);
+}
 
-        strcpy(pathCopy, path);
-        void *childDir = strtok(pathCopy, slash);    
 
-        while(strcmp((char *) childDir, parent->filename) != 0){
-            childDir = strtok(NULL, slash);
-        }
-        if(childDir != NULL){
-            childDir = strtok(NULL, slash);
-        }
-        
+static int sfs_mkdir(const char *path, mode_t mode)
+{
+    (void)mode;
+    return sfs_dir_create(img, path);
+}
 
-        for (unsigned int i=0; i < parent_nentries; i++){
-            
-            if(strlen(dir[i].filename) > 0 && strcmp(dir[i].filename, childDir) == 0){ 
-                
-                struct sfs_entry *newparent = &dir[i];
-                disk_read(ret_entry, sizeof(struct sfs_entry), SFS_DATA_OFF + parent_blockidx * SFS_BLOCK_SIZE + i * sizeof(struct sfs_entry));
+static int sfs_rmdir(const char *path)
+{
+    return sfs_dir_remove(img, path);
+}
 
-                res = get_entry_rec(path, newparent, SFS_DIR_NENTRIES, dir[i].first_block, ret_entry, ret_entry_off);
+static int sfs_unlink(const char *path)
+{
+    return sfs_file_unlink(img, path);
+}
 
-                return res;
-            }
-        }
-        
+static int sfs_truncate(const char *path, off_t size)
+{
+    return sfs_file_truncate(img, path, size);
+}
 
-        return 1;
-    }
-    else {
-        log("not correct parentnentries");
-        return 1;
-    }
 
-    // log("path after: %s", (char *) path);
+static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void)mode;
+    struct sfs_file *file;
 
+    int res = sfs_file_create(img, path, &file);
+    if (res == 0)
+        fi->fh = (uintptr_t)file;
     return res;
 }
 
-
-/*
- * Retrieve information about a file or directory.
- * You should populate fields of `stbuf` with appropriate information if the
- * file exists and is accessible, or return an error otherwise.
- *
- * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
- * For files, you should at least set st_mode (with S_IFREG), st_nlink and
- * st_size.
- *
- * Return 0 on success, < 0 on error.
- */
-static int sfs_getattr(const char *path,
-                       struct stat *st)
+static int sfs_open(const char *path, struct fuse_file_info *fi)
 {
-    int res = -ENOENT;
-
-    log("getattr %s\n", path);
-
-    memset(st, 0, sizeof(struct stat));
-    /* Set owner to user/group who mounted the image */
-    st->st_uid = getuid();
-    st->st_gid = getgid();
-    /* Last accessed/modified just now */
-    st->st_atime = time(NULL);
-    st->st_mtime = time(NULL);
-
-    char pathCopy[200];    
-    void *lastDir = NULL;
-    const char slash[2] = "/";
-    
-    strcpy(pathCopy, path);
-    lastDir = strtok(pathCopy, slash);
-
-    if(lastDir != NULL){
-        void *temp = lastDir;
-
-        while(temp != NULL){
-            lastDir = temp;
-            if(strlen(lastDir) >= 58){
-                return -ENAMETOOLONG;
-            }
-            temp = strtok(NULL, slash);
-        }
-
-        if(strlen(lastDir) >= 58){
-            return -ENAMETOOLONG;
-        }
-    }
-
-    if (strcmp(path, "/") == 0) {
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
-        res = 0;
-    }else if(lastDir != NULL){
-
-        struct sfs_entry *entry = malloc(64);
-
-        if(get_entry_rec(path, NULL, SFS_ROOTDIR_NENTRIES, 0, entry, NULL) > 0 ){
-            return -ENOENT;
-        }
-
-        if(entry->size & SFS_DIRECTORY){
-            log("is dir");
-            st->st_mode = S_IFDIR | 0755;
-            st->st_nlink = 2;
-        }
-        else {
-            log("is file");
-            st->st_mode = S_IFREG | 0755;
-            st->st_nlink = 1;
-            st->st_size = entry->size & SFS_SIZEMASK;
-        }   
-        res = 0;
-    }
-    else {
-
-        struct sfs_entry rootdir[SFS_ROOTDIR_NENTRIES];
-        disk_read(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-
-        for (unsigned int i=0; i < SFS_ROOTDIR_NENTRIES; i++){
-
-            if(strcmp(rootdir[i].filename, &path[1]) == 0){
-                if(rootdir[i].size & SFS_DIRECTORY){
-                    st->st_mode = S_IFDIR | 0755;
-                    st->st_nlink = 2;
-                }
-                else {
-                    st->st_mode = S_IFREG | 0755;
-                    st->st_nlink = 1;
-                    st->st_size = rootdir[i].size & SFS_SIZEMASK;
-                }
-
-                res = 0;
-            }
-        }
-           
-    }
+    struct sfs_file *file;
 
+    int res = sfs_file_open(img, path, fi->flags, &file);
+    if (res == 0)
+        fi->fh = (uintptr_t)file;
     return res;
 }
 
-
 /*
- * Return directory contents for `path`. This function should simply fill the
- * filenames - any additional information (e.g., whether something is a file or
- * directory) is later retrieved through getattr calls.
- * Use the function `filler` to add an entry to the directory. Use it like:
- *  filler(buf, <dirname>, NULL, 0);
- * Return 0 on success, < 0 on error.
+ * Write out buffered data when a file descriptor is closed, or on fsync.
  */
-static int sfs_readdir(const char *path,
-                       void *buf,
-                       fuse_fill_dir_t filler,
-                       off_t offset,
-                       struct fuse_file_info *fi)
+static int sfs_flush(const char *path, struct fuse_file_info *fi)
 {
-    (void)offset, (void)fi;
-    log("readdir %s\n", path);
-
-    (void)filler; /* Placeholder - use me */
-    (void)buf; /* Placeholder - use me */
-
-    if(strcmp(path, "/") == 0){
-        struct sfs_entry rootdir[SFS_ROOTDIR_NENTRIES];
-        disk_read(rootdir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-
-        for (unsigned int i=0; i < SFS_ROOTDIR_NENTRIES; i++){
-
-            if(strlen(rootdir[i].filename) > 0){
-                filler(buf, rootdir[i].filename, NULL, 0);
-            }
-        }
-   }
-   else {
-
-        struct sfs_entry *entry = malloc(64);
-
-        if (get_entry_rec(path, NULL, SFS_ROOTDIR_NENTRIES, 0, entry, NULL) > 0){
-            return -ENOENT;
-        }
-
-        struct sfs_entry temp[16];
-
-        disk_read(temp, SFS_DIR_SIZE, SFS_DATA_OFF + entry->first_block * SFS_BLOCK_SIZE);
-        
-        for(unsigned int i=0; i < 16; i++){
-            
-            if(strlen(temp[i].filename) > 0){
-                log("fill in entry %s", temp[i].filename);
-                filler(buf, temp[i].filename, NULL, 0);
-            } 
-        }
-
-    }
-
-    return 0;
+    (void)path;
+    return fi->fh != 0 ? sfs_file_sync(FI_FILE(fi)) : 0;
 }
 
-
-/*
- * Read contents of `path` into `buf` for  up to `size` bytes.
- * Note that `size` may be bigger than the file actually is.
- * Reading should start at offset `offset`; the OS will generally read your file
- * in chunks of 4K byte.
- * Returns the number of bytes read (writing into `buf`), or < 0 on error.
- */
-static int sfs_read(const char *path,
-                    char *buf,
-                    size_t size,
-                    off_t offset,
-                    struct fuse_file_info *fi)
+static int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    (void)fi;
-    log("read %s size=%zu offset=%ld\n", path, size, offset);
-
-    (void)buf; /* Placeholder - use me */
-
-    struct sfs_entry entry[16];
-
-    if(get_entry_rec(path, NULL, SFS_ROOTDIR_NENTRIES, 0, entry, NULL) > 0){
-        return -ENOENT;
-    }
-        
-    blockidx_t blockID = entry[0].first_block;
-    size_t remainingBytes;
-
-    if(entry[0].size < size){
-        remainingBytes = entry[0].size;
-    }
-    else {
-        remainingBytes = size;
-    }
-        
-    int bytesRead = 0;
-    off_t currOffset = offset;
-    
-    // assert((blockID != SFS_BLOCKIDX_EMPTY) && (blockID != SFS_BLOCKIDX_END));
-
-    while(currOffset >= 512){
-        blockidx_t *buffer = malloc(2);
-        disk_read(buffer, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blockID * 2);
-        blockID = *buffer;
-        currOffset -= 512;
-    }
-
-    while(remainingBytes > 0){
-
-        currOffset = SFS_DATA_OFF + blockID * SFS_BLOCK_SIZE;
-
-        if(remainingBytes < 512){
-            disk_read(buf+bytesRead, remainingBytes, currOffset);
-            bytesRead += remainingBytes;
-            remainingBytes = 0;
-            return bytesRead;
-        }
-        else if(remainingBytes >= 512){    
-            disk_read(buf+bytesRead, SFS_BLOCK_SIZE, currOffset);
-            bytesRead += 512;
-            remainingBytes -= 512;
-        }
-        
-
-        blockidx_t *buffer = malloc(2);
-        disk_read(buffer, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blockID * 2);
-        blockID = *buffer;
-
-        log("block id: %x", blockID);
-        // log("remaining bytes: %i", remainingBytes);
-
-        currOffset = 0;
-    }
-    
-    return bytesRead;    
+    (void)datasync;
+    return sfs_flush(path, fi);
 }
 
-
 /*
- * Create directory at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
+ * Called once the last file descriptor for an open file is gone.
  */
-static int sfs_mkdir(const char *path,
-                     mode_t mode)
+static int sfs_release(const char *path, struct fuse_file_info *fi)
 {
-    log("mkdir %s mode=%o\n", path, mode);
-
-    char pathCopy[100];    
-    void *lastDir = NULL;
-    const char slash[2] = "/";
-    
-    strcpy(pathCopy, path);
-    lastDir = strtok(pathCopy, slash);
-    const void *childDir = lastDir;
-
-    if(lastDir != NULL){
-        void *temp = lastDir;
-
-        while(temp != NULL){
-            lastDir = temp;
-            if(strlen(lastDir) >= 58){
-               return -ENAMETOOLONG;
-            }
-
-            temp = strtok(NULL, slash);
-        }
-    }
-
-    if(strlen(lastDir) >= 58){
-        return -ENAMETOOLONG;
-    }
-
-    struct sfs_entry *entry = malloc(64);
-    unsigned int n_entries;
-
-    if(strcmp(lastDir, childDir) == 0){
-        log("entry:64");
-        n_entries = SFS_ROOTDIR_NENTRIES;
-    }
-    else {
-        if (get_entry_rec(path, NULL, SFS_ROOTDIR_NENTRIES, 0, entry, NULL) == 0){
-            log("something went wrong");
-        }
-        log("returned entry: %s", entry->filename);
-        log("entry:16");
-        n_entries = SFS_DIR_NENTRIES;
-    }
-
-    struct sfs_entry dir[n_entries];
-    off_t offset = 0;
-
-    if(n_entries == SFS_ROOTDIR_NENTRIES){
-        log("rootread");
-        offset += SFS_ROOTDIR_OFF;
-        disk_read(dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-    }else{
-        log("subdirread: %x", (unsigned int) entry->first_block);
-        offset += SFS_DATA_OFF + entry->first_block * SFS_BLOCK_SIZE;
-        disk_read(dir, SFS_DIR_SIZE, SFS_DATA_OFF + entry->first_block * SFS_BLOCK_SIZE);
-    }
-
-
-    for(unsigned int i=0; i<n_entries; i++){
-        log("name: %s", (char *) dir[i].filename);
-        if(strlen(dir[i].filename) < 1){
-            log("empty at: %i", i);
-            offset += i * sizeof(struct sfs_entry);
-            break;
-        }
-    }
-    
-    blockidx_t *buffer1 = malloc(2);
-    blockidx_t *buffer2 = malloc(2);
-    blockidx_t blockID1 = 0;
-
-    for(unsigned int i = 0; i<SFS_BLOCKTBL_NENTRIES-3; i++){
-
-        disk_read(buffer1, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + i * 2);
-        disk_read(buffer2, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + (i+1) * 2);
-
-        if(*buffer1 == SFS_BLOCKIDX_EMPTY && *buffer2 == SFS_BLOCKIDX_EMPTY){
-            log("empty at %i and %i", i, i+1);
-
-            blockID1 = i;
-
-            blockidx_t temp = i+1;
-            blockidx_t *ptr = &temp;
-
-            disk_write(ptr, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + i * 2);
-
-            temp = SFS_BLOCKIDX_END;
-            ptr = &temp;
-
-            disk_write(ptr, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + (i+1) * 2);    
-
-            break;
-        }
-
-    }
-
-    struct sfs_entry new_dir[n_entries];
-
-    for(unsigned int i=0; i<n_entries; i++){
-        strcpy(new_dir[i].filename, "\0");
-        new_dir[i].first_block = SFS_BLOCKIDX_EMPTY;
-        new_dir[i].size = 0;
-    }
-
-    disk_write(new_dir, sizeof(struct sfs_entry) * n_entries, SFS_DATA_OFF + blockID1 * SFS_BLOCK_SIZE);
-
-    struct sfs_entry *new_entry = malloc(64);
-    strcpy(new_entry->filename, (char *)lastDir);
-    new_entry->size = SFS_DIRECTORY;
-    new_entry->first_block = blockID1;
-
-    disk_write(new_entry, sizeof(struct sfs_entry), offset);
-    
-
-    return 0;
+    (void)path;
+    return fi->fh != 0 ? sfs_file_close(FI_FILE(fi)) : 0;
 }
 
 
 /*
- * Remove directory at `path`.
- * Directories may only be removed if they are empty, otherwise this function
- * should return -ENOTEMPTY.
- * Returns 0 on success, < 0 on error.
+ * Move/rename the file at `path` to `newpath`.
+ * Returns 0 on succes, < 0 on error.
  */
-static int sfs_rmdir(const char *path)
+static int sfs_rename(const char *path,
+                      const char *newpath)
 {
-    log("rmdir %s\n", path);
-
-    char pathCopy[100];    
-    void *lastDir = NULL;
-    const char slash[2] = "/";
-    
-    strcpy(pathCopy, path);
-    lastDir = strtok(pathCopy, slash);
-    const void *childDir = lastDir;
-
-
-    if(lastDir != NULL){
-        void *temp = lastDir;
-
-        while(temp != NULL){
-            lastDir = temp;
-            if(strlen(lastDir) >= 58){
-               return -ENAMETOOLONG;
-            }
-
-            temp = strtok(NULL, slash);
-        }
-    }
-
-    struct sfs_entry *entry = malloc(64);
-    void *memory = malloc(sizeof(unsigned));
-    unsigned *entry_off = (unsigned *)memory;
-
-    if(get_entry_rec(path, NULL, SFS_ROOTDIR_NENTRIES, 0, entry, entry_off) > 0){
-        log("cant find dir");
-        return -ENOSYS;
-    }
-
-    struct sfs_entry dir[16];
-
-    disk_read(dir, SFS_DIR_SIZE, SFS_DATA_OFF + entry->first_block * SFS_BLOCK_SIZE);
-
-    unsigned int found = 0;
-
-    for(unsigned int i=0; i<SFS_DIR_NENTRIES; i++){
-        if(strlen(dir[i].filename) > 0){
-            found = 1;
-        }
-    }
-
-    log("found: %i", found);
-
-    if(found == 1){
-        return -ENOTEMPTY;
-    }
-    else {
-        
-        if(strcmp(childDir, lastDir) == 0){
-
-
-            struct sfs_entry parentDir[SFS_ROOTDIR_NENTRIES];
-            disk_read(parentDir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-
-            unsigned int index = (*entry_off - SFS_ROOTDIR_OFF) / sizeof(struct sfs_entry);
-            blockidx_t blockID = parentDir[index].first_block;
-
-            blockidx_t temp = SFS_BLOCKIDX_EMPTY;
-            blockidx_t *input = &temp;
-
-            disk_write(input, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blockID * 2);
-            disk_write(input, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + (blockID+1) * 2);
-
-            
-            struct sfs_entry *new_entry = malloc(64);
-
-            strcpy(new_entry->filename, "\0");
-            new_entry->size = 0;
-            new_entry->first_block = SFS_BLOCKIDX_EMPTY;
-
-            disk_write(new_entry, sizeof(struct sfs_entry), *entry_off);
-
-            return 0;
-
-        }
-        else {
-            
-            struct sfs_entry parentDir[SFS_DIR_NENTRIES];
-                    
-            disk_read(parentDir, SFS_DIR_SIZE, *entry_off);
-
-            blockidx_t blockID = 0;
-            unsigned int index = 0;
-            for(unsigned int i=0; i<SFS_DIR_NENTRIES; i++){
-                if(strcmp(parentDir[i].filename, entry->filename) == 0 && parentDir[i].first_block == entry->first_block){
-                    log("found at %i", i);
-                    index = i;
-                    blockID = parentDir[i].first_block;
-                    break;
-                }
-            }
-
-            blockidx_t temp = SFS_BLOCKIDX_EMPTY;
-            blockidx_t *input = &temp;
-
-            disk_write(input, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + blockID * 2);
-            disk_write(input, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + (blockID+1) * 2);
-
-            
-            struct sfs_entry *new_entry = malloc(64);
-
-            strcpy(new_entry->filename, "\0");
-            new_entry->size = 0;
-            new_entry->first_block = SFS_BLOCKIDX_EMPTY;
-
-            disk_write(new_entry, sizeof(struct sfs_entry), ((*entry_off) + index * sizeof(struct sfs_entry)));
-
-        }
-
-
+    /* Implementing this function is optional, and not worth any points. */
+    (void)path, (void)newpath;
 
+    return -ENOSYS;
+}
 
 
-    }
+static int sfs_getxattr(const char *path, const char *name, char *value,
+                        size_t size)
+{
+    if (strcmp(name, "user.sfs.compress") != 0)
+        return -ENODATA;
 
+    int res = sfs_file_get_compression(img, path);
+    if (res < 0)
+        return res;
 
-    return 0;
+    if (size > 0)
+        value[0] = res ? '1' : '0';
+    return 1;
 }
 
-
 /*
- * Remove file at `path`.
- * Can not be used to remove directories.
- * Returns 0 on success, < 0 on error.
+ * Files are compressed or not by setting "user.sfs.compress" to 1 or 0, and
+ * cloned by setting "user.sfs.clone" on an existing file to the source path:
+ *  $ touch dst && setfattr -n user.sfs.clone -v /src dst
+ * See sfs_file_clone().
  */
-static int sfs_unlink(const char *path)
+static int sfs_setxattr(const char *path, const char *name, const char *value,
+                        size_t size, int flags)
 {
-    log("unlink %s\n", path);
+    (void)flags;
 
-    return -ENOSYS;
-}
+    if (strcmp(name, "user.sfs.compress") == 0)
+        return sfs_file_set_compression(img, path, size > 0 && value[0] == '1');
+    if (strcmp(name, "user.sfs.clone") != 0)
+        return -ENOTSUP;
 
+    char srcPath[100];
 
-/*
- * Create an empty file at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_create(const char *path,
-                      mode_t mode,
-                      struct fuse_file_info *fi)
-{
-    (void)fi;
-    log("create %s mode=%o\n", path, mode);
+    if (size >= sizeof(srcPath))
+        return -ENAMETOOLONG;
+    memcpy(srcPath, value, size);
+    srcPath[size] = '\0';
 
-    return -ENOSYS;
+    return sfs_file_clone(img, srcPath, path);
 }
 
 
-/*
- * Shrink or grow the file at `path` to `size` bytes.
- * Excess bytes are thrown away, whereas any bytes added in the process should
- * be nil (\0).
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_truncate(const char *path, off_t size)
+static int sfs_statfs(const char *path, struct statvfs *st)
 {
-    log("truncate %s size=%ld\n", path, size);
-
-    return -ENOSYS;
+    (void)path;
+    return sfs_image_statfs(img, st);
 }
 
 
-/*
- * Write contents of `buf` (of `size` bytes) to the file at `path`.
- * The file is grown if nessecary, and any bytes already present are overwritten
- * (whereas any other data is left intact). The `offset` argument specifies how
- * many bytes should be skipped in the file, after which `size` bytes from
- * buffer are written.
- * This means that the new file size will be max(old_size, offset + size).
- * Returns the number of bytes written, or < 0 on error.
- */
-static int sfs_write(const char *path,
-                     const char *buf,
-                     size_t size,
-                     off_t offset,
-                     struct fuse_file_info *fi)
+static void *sfs_init(struct fuse_conn_info *conn)
 {
-    (void)fi;
-    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int)size, buf,
-        size, offset);
-    return -ENOSYS;   
+    (void)conn;
 
+    /* Started here rather than in main, since fuse_main may fork to run in
+     * the background and threads do not survive that. */
+    sfs_image_start(img);
+    return NULL;
 }
 
-
-/*
- * Move/rename the file at `path` to `newpath`.
- * Returns 0 on succes, < 0 on error.
- */
-static int sfs_rename(const char *path,
-                      const char *newpath)
+static void sfs_destroy(void *private_data)
 {
-    /* Implementing this function is optional, and not worth any points. */
-    log("rename %s %s\n", path, newpath);
-
-    return -ENOSYS;
+    (void)private_data;
+    sfs_close_image(img);
+    sfs_trace_stop();
 }
 
 
@@ -803,9 +254,161 @@ static const struct fuse_operations sfs_oper = {
     .truncate   = sfs_truncate,
     .write      = sfs_write,
     .rename     = sfs_rename,
+    .setxattr   = sfs_setxattr,
+    .getxattr   = sfs_getxattr,
+    .statfs     = sfs_statfs,
+    .open       = sfs_open,
+    .flush      = sfs_flush,
+    .fsync      = sfs_fsync,
+    .release    = sfs_release,
+    .init       = sfs_init,
+    .destroy    = sfs_destroy,
+};
+
+
+/*
+ * With --trace, the callbacks above are wrapped to record every operation,
+ * see sfs_trace.h. This is a separate table, so an untraced mount does not
+ * pay for it at all.
+ */
+#define FI_TRACE_FLAGS  (fi != NULL && fi->fh != 0 ? SFS_TRACE_HANDLE : 0)
+#define FI_TRACE_FH     (fi != NULL ? fi->fh : 0)
+
+#define TRACED(name, op, params, args, flags, fh, offset, size)         \
+    static int trace_##name params                                      \
+    {                                                                   \
+        uint64_t start = sfs_trace_now();                               \
+        sfs_trace_begin(path, NULL);                                    \
+        int res = sfs_##name args;                                      \
+        sfs_trace_record(op, flags, path, NULL, fh, offset, size,       \
+                         start, res);                                   \
+        return res;                                                     \
+    }
+
+TRACED(getattr, SFS_TRACE_GETATTR,
+       (const char *path, struct stat *st),
+       (path, st), 0, 0, 0, 0)
+TRACED(readdir, SFS_TRACE_READDIR,
+       (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+        struct fuse_file_info *fi),
+       (path, buf, filler, offset, fi), 0, 0, 0, 0)
+TRACED(read, SFS_TRACE_READ,
+       (const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi),
+       (path, buf, size, offset, fi),
+       FI_TRACE_FLAGS, FI_TRACE_FH, offset, size)
+TRACED(write, SFS_TRACE_WRITE,
+       (const char *path, const char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi),
+       (path, buf, size, offset, fi),
+       FI_TRACE_FLAGS, FI_TRACE_FH, offset, size)
+TRACED(mkdir, SFS_TRACE_MKDIR,
+       (const char *path, mode_t mode),
+       (path, mode), 0, 0, 0, 0)
+TRACED(rmdir, SFS_TRACE_RMDIR,
+       (const char *path),
+       (path), 0, 0, 0, 0)
+TRACED(unlink, SFS_TRACE_UNLINK,
+       (const char *path),
+       (path), 0, 0, 0, 0)
+TRACED(truncate, SFS_TRACE_TRUNCATE,
+       (const char *path, off_t size),
+       (path, size), 0, 0, size, 0)
+TRACED(create, SFS_TRACE_CREATE,
+       (const char *path, mode_t mode, struct fuse_file_info *fi),
+       (path, mode, fi), 0, fi->fh, 0, 0)
+TRACED(open, SFS_TRACE_OPEN,
+       (const char *path, struct fuse_file_info *fi),
+       (path, fi), 0, fi->fh, 0, fi->flags & O_ACCMODE)
+TRACED(flush, SFS_TRACE_FLUSH,
+       (const char *path, struct fuse_file_info *fi),
+       (path, fi), FI_TRACE_FLAGS, FI_TRACE_FH, 0, 0)
+TRACED(fsync, SFS_TRACE_FSYNC,
+       (const char *path, int datasync, struct fuse_file_info *fi),
+       (path, datasync, fi), FI_TRACE_FLAGS, FI_TRACE_FH, 0, 0)
+TRACED(release, SFS_TRACE_RELEASE,
+       (const char *path, struct fuse_file_info *fi),
+       (path, fi), FI_TRACE_FLAGS, FI_TRACE_FH, 0, 0)
+TRACED(rename, SFS_TRACE_RENAME,
+       (const char *path, const char *newpath),
+       (path, newpath), 0, 0, 0, 0)
+TRACED(getxattr, SFS_TRACE_GETXATTR,
+       (const char *path, const char *name, char *value, size_t size),
+       (path, name, value, size),
+       strcmp(name, "user.sfs.compress") == 0 ? SFS_TRACE_XCOMPRESS : 0,
+       0, 0, 0)
+TRACED(statfs, SFS_TRACE_STATFS,
+       (const char *path, struct statvfs *st),
+       (path, st), 0, 0, 0, 0)
+
+/* Setxattr records the value as well, so clones can be replayed. */
+static int trace_setxattr(const char *path, const char *name,
+                          const char *value, size_t size, int flags)
+{
+    uint64_t start = sfs_trace_now();
+    int clone = strcmp(name, "user.sfs.clone") == 0;
+    char srcPath[100];
+
+    if (clone)
+        snprintf(srcPath, sizeof(srcPath), "%.*s", (int)size, value);
+    sfs_trace_begin(path, clone ? srcPath : NULL);
+
+    int res = sfs_setxattr(path, name, value, size, flags);
+
+    if (strcmp(name, "user.sfs.compress") == 0) {
+        sfs_trace_record(SFS_TRACE_SETXATTR, SFS_TRACE_XCOMPRESS, path, NULL,
+                         0, 0, size > 0 && value[0] == '1', start, res);
+    } else if (clone) {
+        sfs_trace_record(SFS_TRACE_SETXATTR, SFS_TRACE_XCLONE, path, srcPath,
+                         0, 0, 0, start, res);
+    } else {
+        sfs_trace_record(SFS_TRACE_SETXATTR, 0, path, NULL, 0, 0, 0, start,
+                         res);
+    }
+    return res;
+}
+
+static const struct fuse_operations sfs_trace_oper = {
+    .getattr    = trace_getattr,
+    .readdir    = trace_readdir,
+    .read       = trace_read,
+    .mkdir      = trace_mkdir,
+    .rmdir      = trace_rmdir,
+    .unlink     = trace_unlink,
+    .create     = trace_create,
+    .truncate   = trace_truncate,
+    .write      = trace_write,
+    .rename     = trace_rename,
+    .setxattr   = trace_setxattr,
+    .getxattr   = trace_getxattr,
+    .statfs     = trace_statfs,
+    .open       = trace_open,
+    .flush      = trace_flush,
+    .fsync      = trace_fsync,
+    .release    = trace_release,
+    .init       = sfs_init,
+    .destroy    = sfs_destroy,
 };
 
 
+static void defrag_report(const char *when)
+{
+    struct sfs_frag_stats stats;
+
+    sfs_image_frag_stats(img, &stats);
+    printf("%s: %lu blocks in %lu runs, average run length %.2f\n", when,
+           stats.blocks, stats.runs,
+           stats.runs ? (double)stats.blocks / stats.runs : 0.0);
+}
+
+static long ms_since(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+
 #define OPTION(t, p)                            \
     { t, offsetof(struct options, p), 1 }
 #define LOPTION(s, l, p)                        \
@@ -815,6 +418,13 @@ static const struct fuse_opt option_spec[] = {
     LOPTION("-i %s",    "--img=%s",     img),
     LOPTION("-b",       "--background", background),
     LOPTION("-v",       "--verbose",    verbose),
+    LOPTION("-c",       "--compress",   compress),
+    OPTION(             "--defrag",     defrag),
+    OPTION(             "--autodefrag", autodefrag),
+    OPTION(             "--pack=%s",    pack),
+    OPTION(             "--unpack=%s",  unpack),
+    OPTION(             "--trace=%s",   trace),
+    OPTION(             "--trace-size=%u", trace_size),
     LOPTION("-h",       "--help",       show_help),
     OPTION(             "--fuse-help",  show_fuse_help),
     FUSE_OPT_END
@@ -832,16 +442,30 @@ static void show_help(const char *progname)
            "                        (default: \"%s\")\n"
            "    -b, --background    run fuse in background\n"
            "    -v, --verbose       print debug information\n"
+           "    -c, --compress      compress newly created files\n"
+           "        --defrag        defragment the image and exit (same as\n"
+           "                        running as sfs_defrag)\n"
+           "        --autodefrag    defragment in the background when idle\n"
+           "        --pack=DIR      replace the contents of the image with\n"
+           "                        directory DIR and exit (sfs_pack)\n"
+           "        --unpack=DIR    extract the image into DIR and exit\n"
+           "                        (sfs_unpack)\n"
+           "        --trace=FILE    record all operations to FILE, to be\n"
+           "                        replayed with sfs_replay\n"
+           "        --trace-size=MB keep only the last MB megabytes of the\n"
+           "                        trace (default: %u)\n"
            "    -h, --help          show this summarized help\n"
            "        --fuse-help     show full FUSE help\n"
-           "\n", default_img);
+           "\n", default_img, default_trace_size);
 }
 
 int main(int argc, char **argv)
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    const char *progname = basename(argv[0]);
 
     options.img = strdup(default_img);
+    options.trace_size = default_trace_size;
 
     fuse_opt_parse(&args, &options, option_spec, NULL);
 
@@ -855,10 +479,76 @@ int main(int argc, char **argv)
         args.argv[0][0] = '\0';
     }
 
+    /* When run as sfs_pack or sfs_unpack, the directory is the first
+     * non-option argument. */
+    if (strcmp(progname, "sfs_pack") == 0 && !options.pack && args.argc > 1)
+        options.pack = args.argv[1];
+    if (strcmp(progname, "sfs_unpack") == 0 && !options.unpack && args.argc > 1)
+        options.unpack = args.argv[1];
+
     if (!options.background)
         assert(fuse_opt_add_arg(&args, "-f") == 0);
 
-    disk_open_image(options.img);
+    /* Have the kernel hand us writes in large chunks rather than per page, so
+     * the write buffers see fewer, bigger requests. (libfuse 2 has no
+     * writeback_cache, so buffering is done on our side only.) */
+    assert(fuse_opt_add_arg(&args, "-obig_writes,max_write=131072") == 0);
+
+    /* Without rename, the kernel cannot hide a file that is unlinked while
+     * open as .fuse_hiddenXXX, so have it unlink right away. Reads through
+     * handles still open then fail with ENOENT. */
+    assert(fuse_opt_add_arg(&args, "-ohard_remove") == 0);
+
+    sfs_verbose = options.verbose;
+    img = sfs_open_image(options.img, (options.compress ? SFS_OPEN_COMPRESS : 0) |
+                                      (options.autodefrag ? SFS_OPEN_AUTODEFRAG : 0));
+    if (img == NULL) {
+        perror(options.img);
+        return 1;
+    }
+
+    if (options.pack) {
+        struct timespec start;
+        struct statvfs st;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int res = sfs_image_pack(img, options.pack);
+        if (res == 0) {
+            sfs_image_statfs(img, &st);
+            printf("packed %s: %lu of %lu blocks used, %ld ms\n", options.pack,
+                   (unsigned long)(st.f_blocks - st.f_bfree),
+                   (unsigned long)st.f_blocks, ms_since(&start));
+        }
+        sfs_close_image(img);
+        return res < 0;
+    }
+
+    if (options.unpack) {
+        int res = sfs_image_unpack(img, options.unpack);
+        sfs_close_image(img);
+        return res < 0;
+    }
+
+    if (options.defrag || strcmp(progname, "sfs_defrag") == 0) {
+        defrag_report("before");
+        sfs_image_defrag(img);
+        defrag_report("after");
+        sfs_close_image(img);
+        return 0;
+    }
+
+    if (options.trace) {
+        uint64_t nrecords = (uint64_t)options.trace_size * 1024 * 1024 /
+                            sizeof(struct sfs_trace_rec);
+        int res = sfs_trace_start(options.trace, nrecords);
+        if (res < 0) {
+            fprintf(stderr, "%s: %s\n", options.trace, strerror(-res));
+            sfs_close_image(img);
+            return 1;
+        }
+        sfs_image_set_lock_hook(img, sfs_trace_order, NULL);
+    }
 
-    return fuse_main(args.argc, args.argv, &sfs_oper, NULL);
+    return fuse_main(args.argc, args.argv,
+                     options.trace ? &sfs_trace_oper : &sfs_oper, NULL);
 }
@@ -0,0 +1,543 @@
+/*
+ * sfs_replay: replay a trace recorded with `sfs --trace=FILE`, and report the
+ * latency of every kind of operation.
+ *
+ * Operations are replayed one at a time in the order they were recorded,
+ * either directly on an image through libsfs, or through the POSIX calls that
+ * cause them on a mounted filesystem. The contents of writes are not in the
+ * trace, so a fixed pattern is written instead.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+#include "sfs_trace.h"
+
+
+static const char default_img[] = "test.img";
+
+/* Options passed from commandline arguments */
+struct options {
+    const char *img;
+    const char *mount;
+    const char *trace;
+    int realtime;
+    int recorded;
+    int print;
+    int compress;
+    int autodefrag;
+} options;
+
+/* Returned by the replay functions for operations that cannot be replayed. */
+#define REPLAY_SKIP     INT_MIN
+
+#define REPLAY_MAX_FILES    1024
+
+/*
+ * Files open in the trace, by their fh in the trace. Replaying on an image
+ * keeps a libsfs handle, replaying on a mount a file descriptor.
+ */
+static struct open_file {
+    int used;
+    uint32_t fh;
+    struct sfs_file *file;
+    int fd;
+} files[REPLAY_MAX_FILES];
+
+static struct sfs_image *img;
+static char *buf;
+static size_t buf_size;
+
+
+static struct open_file *file_get(const struct sfs_trace_op *op)
+{
+    if (!(op->flags & SFS_TRACE_HANDLE))
+        return NULL;
+    for (int i = 0; i < REPLAY_MAX_FILES; i++)
+        if (files[i].used && files[i].fh == op->fh)
+            return &files[i];
+    return NULL;
+}
+
+static struct open_file *file_add(uint32_t fh)
+{
+    for (int i = 0; i < REPLAY_MAX_FILES; i++) {
+        if (!files[i].used) {
+            files[i].used = 1;
+            files[i].fh = fh;
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Make sure `buf` holds at least `size` bytes. The data written is a pattern
+ * that compresses somewhat, like most real files.
+ */
+static int buf_reserve(size_t size)
+{
+    if (size <= buf_size)
+        return 0;
+
+    char *newbuf = realloc(buf, size);
+    if (newbuf == NULL)
+        return -ENOMEM;
+    for (size_t i = buf_size; i < size; i++)
+        newbuf[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44] ^
+                    (i / 4096 & 0x7);
+    buf = newbuf;
+    buf_size = size;
+    return 0;
+}
+
+
+static int count_entry(void *arg, const char *name)
+{
+    (void)name;
+    (*(int *)arg)++;
+    return 0;
+}
+
+/*
+ * Replay `op` on the image through libsfs, the same way sfs.c does for the
+ * FUSE callback.
+ */
+static int replay_image(const struct sfs_trace_op *op)
+{
+    struct open_file *f = file_get(op);
+    struct stat st;
+    struct statvfs stv;
+    int n = 0, res;
+
+    if (f == NULL && op->path == NULL && op->op != SFS_TRACE_STATFS)
+        return REPLAY_SKIP;
+
+    switch (op->op) {
+    case SFS_TRACE_GETATTR:
+        return sfs_path_stat(img, op->path, &st);
+    case SFS_TRACE_READDIR:
+        return sfs_dir_list(img, op->path, count_entry, &n);
+    case SFS_TRACE_READ:
+        if ((res = buf_reserve(op->size)) < 0)
+            return res;
+        if (f)
+            return sfs_file_pread(f->file, buf, op->size, op->offset);
+        return sfs_file_read(img, op->path, buf, op->size, op->offset);
+    case SFS_TRACE_WRITE:
+        if ((res = buf_reserve(op->size)) < 0)
+            return res;
+        if (f)
+            return sfs_file_pwrite(f->file, buf, op->size, op->offset);
+        return sfs_file_write(img, op->path, buf, op->size, op->offset);
+    case SFS_TRACE_MKDIR:
+        return sfs_dir_create(img, op->path);
+    case SFS_TRACE_RMDIR:
+        return sfs_dir_remove(img, op->path);
+    case SFS_TRACE_UNLINK:
+        return sfs_file_unlink(img, op->path);
+    case SFS_TRACE_TRUNCATE:
+        return sfs_file_truncate(img, op->path, op->offset);
+    case SFS_TRACE_CREATE:
+    case SFS_TRACE_OPEN:
+        if (op->path == NULL || (f = file_add(op->fh)) == NULL)
+            return REPLAY_SKIP;
+        if (op->op == SFS_TRACE_CREATE)
+            res = sfs_file_create(img, op->path, &f->file);
+        else
+            res = sfs_file_open(img, op->path, op->size, &f->file);
+        if (res < 0)
+            f->used = 0;
+        return res;
+    case SFS_TRACE_FLUSH:
+    case SFS_TRACE_FSYNC:
+        return f ? sfs_file_sync(f->file) : REPLAY_SKIP;
+    case SFS_TRACE_RELEASE:
+        if (f == NULL)
+            return REPLAY_SKIP;
+        f->used = 0;
+        return sfs_file_close(f->file);
+    case SFS_TRACE_GETXATTR:
+        if (!(op->flags & SFS_TRACE_XCOMPRESS))
+            return REPLAY_SKIP;
+        res = sfs_file_get_compression(img, op->path);
+        return res < 0 ? res : 1;
+    case SFS_TRACE_SETXATTR:
+        if (op->flags & SFS_TRACE_XCOMPRESS)
+            return sfs_file_set_compression(img, op->path, op->size);
+        if (op->flags & SFS_TRACE_XCLONE && op->path2)
+            return sfs_file_clone(img, op->path2, op->path);
+        return REPLAY_SKIP;
+    case SFS_TRACE_STATFS:
+        return sfs_image_statfs(img, &stv);
+    }
+    return REPLAY_SKIP;
+}
+
+/*
+ * Replay `op` with the system call that makes the kernel send it to the
+ * filesystem mounted on options.mount. The kernel may send other operations
+ * along with it (for example a getattr before an open), which the latency
+ * includes.
+ */
+static int replay_mount(const struct sfs_trace_op *op)
+{
+    struct open_file *f = file_get(op);
+    char path[PATH_MAX], value[16];
+    struct stat st;
+    struct statvfs stv;
+    ssize_t len;
+    int fd, res;
+
+    if (f == NULL && op->path == NULL && op->op != SFS_TRACE_STATFS)
+        return REPLAY_SKIP;
+    if (op->path)
+        snprintf(path, sizeof(path), "%s%s", options.mount, op->path);
+
+    switch (op->op) {
+    case SFS_TRACE_GETATTR:
+        return lstat(path, &st) < 0 ? -errno : 0;
+    case SFS_TRACE_READDIR: {
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+            return -errno;
+        while (readdir(dir))
+            ;
+        closedir(dir);
+        return 0;
+    }
+    case SFS_TRACE_READ:
+    case SFS_TRACE_WRITE:
+        if ((res = buf_reserve(op->size)) < 0)
+            return res;
+        if (f) {
+            fd = f->fd;
+        } else {
+            fd = open(path, op->op == SFS_TRACE_READ ? O_RDONLY : O_WRONLY);
+            if (fd < 0)
+                return -errno;
+        }
+        if (op->op == SFS_TRACE_READ)
+            len = pread(fd, buf, op->size, op->offset);
+        else
+            len = pwrite(fd, buf, op->size, op->offset);
+        res = len < 0 ? -errno : (int)len;
+        if (!f)
+            close(fd);
+        return res;
+    case SFS_TRACE_MKDIR:
+        return mkdir(path, 0755) < 0 ? -errno : 0;
+    case SFS_TRACE_RMDIR:
+        return rmdir(path) < 0 ? -errno : 0;
+    case SFS_TRACE_UNLINK:
+        return unlink(path) < 0 ? -errno : 0;
+    case SFS_TRACE_TRUNCATE:
+        return truncate(path, op->offset) < 0 ? -errno : 0;
+    case SFS_TRACE_CREATE:
+    case SFS_TRACE_OPEN:
+        if (op->path == NULL || (f = file_add(op->fh)) == NULL)
+            return REPLAY_SKIP;
+        if (op->op == SFS_TRACE_CREATE)
+            f->fd = open(path, O_RDWR | O_CREAT, 0644);
+        else
+            f->fd = open(path, op->size & O_ACCMODE);
+        if (f->fd < 0) {
+            f->used = 0;
+            return -errno;
+        }
+        return 0;
+    case SFS_TRACE_FSYNC:
+        if (f == NULL)
+            return REPLAY_SKIP;
+        return fsync(f->fd) < 0 ? -errno : 0;
+    case SFS_TRACE_RELEASE:
+        /* The kernel sends the flush of the trace along with this. */
+        if (f == NULL)
+            return REPLAY_SKIP;
+        f->used = 0;
+        return close(f->fd) < 0 ? -errno : 0;
+    case SFS_TRACE_GETXATTR:
+        if (!(op->flags & SFS_TRACE_XCOMPRESS))
+            return REPLAY_SKIP;
+        len = getxattr(path, "user.sfs.compress", value, sizeof(value));
+        return len < 0 ? -errno : (int)len;
+    case SFS_TRACE_SETXATTR:
+        if (op->flags & SFS_TRACE_XCOMPRESS)
+            res = setxattr(path, "user.sfs.compress", op->size ? "1" : "0", 1, 0);
+        else if (op->flags & SFS_TRACE_XCLONE && op->path2)
+            res = setxattr(path, "user.sfs.clone", op->path2,
+                           strlen(op->path2), 0);
+        else
+            return REPLAY_SKIP;
+        return res < 0 ? -errno : 0;
+    case SFS_TRACE_STATFS:
+        return statvfs(options.mount, &stv) < 0 ? -errno : 0;
+    }
+    return REPLAY_SKIP;
+}
+
+
+/* Latencies seen for one kind of operation, in ns. */
+struct op_stats {
+    uint64_t *lat;
+    size_t n, cap;
+    unsigned long errors;       /* Returned an error */
+    unsigned long mismatches;   /* Returned something else than in the trace */
+    unsigned long skipped;
+};
+
+static struct op_stats stats[SFS_TRACE_NOPS];
+
+static void stats_add(struct op_stats *s, uint64_t lat)
+{
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        uint64_t *newlat = realloc(s->lat, cap * sizeof(*newlat));
+        if (newlat == NULL) {
+            perror("sfs_replay");
+            exit(1);
+        }
+        s->lat = newlat;
+        s->cap = cap;
+    }
+    s->lat[s->n++] = lat;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const struct op_stats *s, double p)
+{
+    return s->lat[(size_t)((s->n - 1) * p + 0.5)] / 1000.0;
+}
+
+static void report(void)
+{
+    printf("%-10s %8s %6s %6s %9s %9s %9s %9s %9s %9s\n", "op", "count",
+           "errors", "diff", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    for (int i = 0; i < SFS_TRACE_NOPS; i++) {
+        struct op_stats *s = &stats[i];
+        uint64_t total = 0;
+
+        if (s->n == 0) {
+            if (s->skipped)
+                printf("%-10s %8d %6s %6s (%lu skipped)\n",
+                       sfs_trace_op_name(i), 0, "", "", s->skipped);
+            continue;
+        }
+
+        qsort(s->lat, s->n, sizeof(*s->lat), cmp_u64);
+        for (size_t j = 0; j < s->n; j++)
+            total += s->lat[j];
+
+        printf("%-10s %8zu %6lu %6lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f",
+               sfs_trace_op_name(i), s->n, s->errors, s->mismatches,
+               (double)total / s->n / 1000.0, percentile(s, 0.5),
+               percentile(s, 0.9), percentile(s, 0.99), percentile(s, 0.999),
+               s->lat[s->n - 1] / 1000.0);
+        if (s->skipped)
+            printf(" (%lu skipped)", s->skipped);
+        printf("\n");
+    }
+    printf("(latencies in us; diff counts results that differ from the trace)\n");
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = { t / 1000000000, t % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void print_op(const struct sfs_trace_op *op, int res, uint64_t lat)
+{
+    printf("%12.6f %-9s %s", op->time / 1e9, sfs_trace_op_name(op->op),
+           op->path ? op->path : "?");
+    if (op->path2)
+        printf(" from %s", op->path2);
+    if (op->flags & SFS_TRACE_HANDLE)
+        printf(" fh=%x", op->fh);
+    if (op->op == SFS_TRACE_READ || op->op == SFS_TRACE_WRITE)
+        printf(" %u@%llu", op->size, (unsigned long long)op->offset);
+    printf(" = %d (%.1f us)", op->result, op->latency / 1000.0);
+    if (!options.recorded) {
+        if (res == REPLAY_SKIP)
+            printf(", skipped");
+        else
+            printf(", replay %d (%.1f us)", res, lat / 1000.0);
+    }
+    printf("\n");
+}
+
+static int replay(struct sfs_trace *trace)
+{
+    struct sfs_trace_op op;
+    uint64_t first = 0, start = now_ns();
+    unsigned long nops = 0;
+
+    while (sfs_trace_next(trace, &op)) {
+        if (op.op <= 0 || op.op >= SFS_TRACE_NOPS)
+            continue;
+        struct op_stats *s = &stats[op.op];
+
+        if (options.recorded) {
+            stats_add(s, op.latency);
+            if (op.result < 0)
+                s->errors++;
+            if (options.print)
+                print_op(&op, 0, 0);
+            nops++;
+            continue;
+        }
+
+        if (nops++ == 0)
+            first = op.time;
+        /* Ops are in the order they ran, so one may have started before
+         * the previous ones. */
+        if (options.realtime && op.time > first)
+            sleep_until(start + (op.time - first));
+
+        uint64_t t = now_ns();
+        int res = options.mount ? replay_mount(&op) : replay_image(&op);
+        uint64_t lat = now_ns() - t;
+
+        if (options.print)
+            print_op(&op, res, lat);
+        if (res == REPLAY_SKIP) {
+            s->skipped++;
+            continue;
+        }
+        stats_add(s, lat);
+        if (res < 0)
+            s->errors++;
+        if (res != op.result)
+            s->mismatches++;
+    }
+
+    report();
+    if (!options.recorded) {
+        double secs = (now_ns() - start) / 1e9;
+        printf("%lu ops in %.3f s, %.0f ops/s\n", nops, secs,
+               secs > 0 ? nops / secs : 0.0);
+    }
+    return 0;
+}
+
+
+static void show_help(const char *progname)
+{
+    printf("usage: %s [options] TRACE\n\n", progname);
+    printf("Replay a trace recorded with `sfs --trace=TRACE`, and report the\n"
+           "latency of every kind of operation. Replaying changes the image, so\n"
+           "use a copy of the image as it was when the trace was started.\n\n");
+    printf("options:\n"
+           "    -i, --img=FILE      replay on SFS image FILE directly through\n"
+           "                        libsfs (default: \"%s\")\n"
+           "    -m, --mount=DIR     replay through the filesystem mounted on\n"
+           "                        DIR instead\n"
+           "    -r, --realtime      keep the timing of the trace, rather than\n"
+           "                        replaying as fast as possible\n"
+           "    -R, --recorded      report the latencies recorded in the trace\n"
+           "                        instead of replaying it\n"
+           "    -p, --print         print every operation\n"
+           "    -c, --compress      compress newly created files (with --img)\n"
+           "        --autodefrag    defragment in the background when idle\n"
+           "                        (with --img)\n"
+           "    -h, --help          show this help\n"
+           "\n", default_img);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        { "img",        required_argument,  NULL,   'i' },
+        { "mount",      required_argument,  NULL,   'm' },
+        { "realtime",   no_argument,        NULL,   'r' },
+        { "recorded",   no_argument,        NULL,   'R' },
+        { "print",      no_argument,        NULL,   'p' },
+        { "compress",   no_argument,        NULL,   'c' },
+        { "autodefrag", no_argument,        NULL,   'A' },
+        { "help",       no_argument,        NULL,   'h' },
+        { NULL,         0,                  NULL,   0 }
+    };
+    int c;
+
+    options.img = default_img;
+    while ((c = getopt_long(argc, argv, "i:m:rRpch", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'i': options.img = optarg; break;
+        case 'm': options.mount = optarg; break;
+        case 'r': options.realtime = 1; break;
+        case 'R': options.recorded = 1; break;
+        case 'p': options.print = 1; break;
+        case 'c': options.compress = 1; break;
+        case 'A': options.autodefrag = 1; break;
+        case 'h': show_help(argv[0]); return 0;
+        default: return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        show_help(argv[0]);
+        return 1;
+    }
+    options.trace = argv[optind];
+
+    struct sfs_trace *trace = sfs_trace_open(options.trace);
+    if (trace == NULL) {
+        perror(options.trace);
+        return 1;
+    }
+
+    if (!options.recorded && !options.mount) {
+        img = sfs_open_image(options.img,
+                             (options.compress ? SFS_OPEN_COMPRESS : 0) |
+                             (options.autodefrag ? SFS_OPEN_AUTODEFRAG : 0));
+        if (img == NULL) {
+            perror(options.img);
+            sfs_trace_close(trace);
+            return 1;
+        }
+        sfs_image_start(img);
+    }
+
+    replay(trace);
+
+    /* Files the trace never closed */
+    for (int i = 0; i < REPLAY_MAX_FILES; i++) {
+        if (!files[i].used)
+            continue;
+        if (img)
+            sfs_file_close(files[i].file);
+        else
+            close(files[i].fd);
+    }
+    if (img)
+        sfs_close_image(img);
+    sfs_trace_close(trace);
+    free(buf);
+    return 0;
+}
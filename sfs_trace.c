@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_trace.h"
+
+
+_Static_assert(sizeof(struct sfs_trace_header) == SFS_TRACE_DATA_OFF,
+               "trace header size");
+_Static_assert(sizeof(struct sfs_trace_rec) == 40, "trace record size");
+_Static_assert(sizeof(struct sfs_trace_pathdata) == sizeof(struct sfs_trace_rec),
+               "trace path data size");
+
+#define TRACE_MIN_RECORDS   1024
+
+
+static const char *const op_names[SFS_TRACE_NOPS] = {
+    [SFS_TRACE_PATH]        = "path",
+    [SFS_TRACE_PATHDATA]    = "pathdata",
+    [SFS_TRACE_GETATTR]     = "getattr",
+    [SFS_TRACE_READDIR]     = "readdir",
+    [SFS_TRACE_READ]        = "read",
+    [SFS_TRACE_WRITE]       = "write",
+    [SFS_TRACE_MKDIR]       = "mkdir",
+    [SFS_TRACE_RMDIR]       = "rmdir",
+    [SFS_TRACE_UNLINK]      = "unlink",
+    [SFS_TRACE_TRUNCATE]    = "truncate",
+    [SFS_TRACE_CREATE]      = "create",
+    [SFS_TRACE_OPEN]        = "open",
+    [SFS_TRACE_FLUSH]       = "flush",
+    [SFS_TRACE_FSYNC]       = "fsync",
+    [SFS_TRACE_RELEASE]     = "release",
+    [SFS_TRACE_RENAME]      = "rename",
+    [SFS_TRACE_GETXATTR]    = "getxattr",
+    [SFS_TRACE_SETXATTR]    = "setxattr",
+    [SFS_TRACE_STATFS]      = "statfs",
+};
+
+const char *sfs_trace_op_name(int op)
+{
+    if (op <= 0 || op >= SFS_TRACE_NOPS)
+        return "unknown";
+    return op_names[op];
+}
+
+
+/*
+ * Recording. The ring is mmap()ed, so a record is a few stores into memory
+ * and the kernel writes the file back in its own time. The slot of a record
+ * (and any path definitions it needs) is taken in sfs_trace_order(), with the
+ * lock of the image held, so the ring is in the order the operations ran on
+ * the image; sfs_trace_record() then fills it in once the result is known.
+ * The trace lock is taken twice per operation, once inside the image lock,
+ * and only for the path lookup and the stores: about 170 ns per record.
+ */
+
+struct path_ent {
+    char *name;
+    uint32_t id;
+    uint64_t defined;       /* Index of the SFS_TRACE_PATH record, or
+                               UINT64_MAX if not written out yet */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int active;
+    struct sfs_trace_header *hdr;
+    struct sfs_trace_rec *recs;
+    size_t maplen;
+    uint64_t t0;
+
+    /* Open-addressed hash table of every path seen */
+    struct path_ent *paths;
+    size_t paths_cap, npaths;
+} tr = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* The operation the calling thread is running, see sfs_trace_begin() */
+static __thread struct {
+    int pending;            /* Begun, no slot taken yet */
+    int reserved;           /* Slot taken, not filled in yet */
+    const char *path, *path2;
+    uint32_t id, id2;
+    uint64_t slot;
+} cur;
+
+
+uint64_t sfs_trace_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int sfs_trace_start(const char *filename, uint64_t nrecords)
+{
+    struct timespec now;
+
+    if (nrecords < TRACE_MIN_RECORDS)
+        nrecords = TRACE_MIN_RECORDS;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -errno;
+
+    size_t len = SFS_TRACE_DATA_OFF + nrecords * sizeof(struct sfs_trace_rec);
+    if (ftruncate(fd, len) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    tr.hdr = map;
+    tr.recs = (struct sfs_trace_rec *)((char *)map + SFS_TRACE_DATA_OFF);
+    tr.maplen = len;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(tr.hdr->magic, SFS_TRACE_MAGIC, sizeof(tr.hdr->magic));
+    tr.hdr->version = SFS_TRACE_VERSION;
+    tr.hdr->rec_size = sizeof(struct sfs_trace_rec);
+    tr.hdr->nrecords = nrecords;
+    tr.hdr->head = 0;
+    tr.hdr->start = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    tr.t0 = sfs_trace_now();
+    tr.active = 1;
+    return 0;
+}
+
+void sfs_trace_stop(void)
+{
+    pthread_mutex_lock(&tr.lock);
+    if (tr.active) {
+        tr.active = 0;
+        msync(tr.hdr, tr.maplen, MS_SYNC);
+        munmap(tr.hdr, tr.maplen);
+        for (size_t i = 0; i < tr.paths_cap; i++)
+            free(tr.paths[i].name);
+        free(tr.paths);
+        tr.paths = NULL;
+        tr.paths_cap = tr.npaths = 0;
+    }
+    pthread_mutex_unlock(&tr.lock);
+}
+
+
+static size_t path_hash(const char *path)
+{
+    size_t h = 14695981039346656037u;
+    for (; *path; path++)
+        h = (h ^ (unsigned char)*path) * 1099511628211u;
+    return h;
+}
+
+static struct path_ent *path_lookup(const char *path)
+{
+    if (tr.npaths * 2 >= tr.paths_cap) {
+        size_t cap = tr.paths_cap ? tr.paths_cap * 2 : 1024;
+        struct path_ent *paths = calloc(cap, sizeof(*paths));
+        if (paths == NULL)
+            return NULL;
+        for (size_t i = 0; i < tr.paths_cap; i++) {
+            if (tr.paths[i].name == NULL)
+                continue;
+            size_t j = path_hash(tr.paths[i].name) & (cap - 1);
+            while (paths[j].name)
+                j = (j + 1) & (cap - 1);
+            paths[j] = tr.paths[i];
+        }
+        free(tr.paths);
+        tr.paths = paths;
+        tr.paths_cap = cap;
+    }
+
+    size_t i = path_hash(path) & (tr.paths_cap - 1);
+    while (tr.paths[i].name) {
+        if (strcmp(tr.paths[i].name, path) == 0)
+            return &tr.paths[i];
+        i = (i + 1) & (tr.paths_cap - 1);
+    }
+
+    if ((tr.paths[i].name = strdup(path)) == NULL)
+        return NULL;
+    tr.paths[i].id = ++tr.npaths;
+    tr.paths[i].defined = UINT64_MAX;
+    return &tr.paths[i];
+}
+
+static struct sfs_trace_rec *next_rec(void)
+{
+    return &tr.recs[tr.hdr->head++ % tr.hdr->nrecords];
+}
+
+/*
+ * Return the id of `path`, first writing out its name if this is the first
+ * use, or if the previous definition will soon drop out of the ring.
+ */
+static uint32_t path_id(const char *path)
+{
+    if (path == NULL)
+        return 0;
+
+    struct path_ent *ent = path_lookup(path);
+    if (ent == NULL)
+        return 0;
+
+    uint64_t head = tr.hdr->head;
+    if (ent->defined != UINT64_MAX && head - ent->defined < tr.hdr->nrecords / 2)
+        return ent->id;
+
+    size_t len = strlen(path);
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+
+    struct sfs_trace_rec *rec = next_rec();
+    memset(rec, 0, sizeof(*rec));
+    rec->op = SFS_TRACE_PATH;
+    rec->path = ent->id;
+    rec->size = len;
+    for (size_t off = 0; off < len; off += SFS_TRACE_PATHDATA_LEN) {
+        struct sfs_trace_pathdata *data = (struct sfs_trace_pathdata *)next_rec();
+        size_t n = len - off < SFS_TRACE_PATHDATA_LEN ? len - off
+                                                      : SFS_TRACE_PATHDATA_LEN;
+        data->op = SFS_TRACE_PATHDATA;
+        memcpy(data->data, path + off, n);
+    }
+    ent->defined = head;
+    return ent->id;
+}
+
+void sfs_trace_begin(const char *path, const char *path2)
+{
+    cur.pending = 1;
+    cur.reserved = 0;
+    cur.path = path;
+    cur.path2 = path2;
+}
+
+void sfs_trace_order(void *arg)
+{
+    (void)arg;
+
+    if (!cur.pending)
+        return;
+    cur.pending = 0;
+
+    pthread_mutex_lock(&tr.lock);
+    if (tr.active) {
+        cur.id = path_id(cur.path);
+        cur.id2 = path_id(cur.path2);
+        cur.slot = tr.hdr->head;
+        memset(next_rec(), 0, sizeof(struct sfs_trace_rec));
+        cur.reserved = 1;
+    }
+    pthread_mutex_unlock(&tr.lock);
+}
+
+void sfs_trace_record(int op, int flags, const char *path, const char *path2,
+                      uint64_t fh, uint64_t offset, uint64_t size,
+                      uint64_t start, int result)
+{
+    uint64_t now = sfs_trace_now();
+    struct sfs_trace_rec *rec;
+    uint32_t id;
+
+    pthread_mutex_lock(&tr.lock);
+    if (!tr.active) {
+        cur.pending = cur.reserved = 0;
+        pthread_mutex_unlock(&tr.lock);
+        return;
+    }
+
+    if (cur.reserved) {
+        /* Give up rather than overwrite newer records, should the ring have
+         * come round in the meantime. */
+        if (tr.hdr->head - cur.slot >= tr.hdr->nrecords) {
+            cur.reserved = 0;
+            pthread_mutex_unlock(&tr.lock);
+            return;
+        }
+        rec = &tr.recs[cur.slot % tr.hdr->nrecords];
+        id = cur.id;
+        if (path2)
+            offset = cur.id2;
+    }
+    else {
+        /* The operation never got to the image. */
+        id = path_id(path);
+        if (path2)
+            offset = path_id(path2);
+        rec = next_rec();
+    }
+    cur.pending = cur.reserved = 0;
+
+    rec->op = op;
+    rec->flags = flags;
+    rec->reserved = 0;
+    rec->path = id;
+    /* Handles are pointers, and those of files open at the same time differ
+     * well within the low bits. */
+    rec->fh = fh >> 4;
+    rec->size = size;
+    rec->latency = now - start > UINT32_MAX ? UINT32_MAX : now - start;
+    rec->result = result;
+    rec->time = start - tr.t0;
+    rec->offset = offset;
+    pthread_mutex_unlock(&tr.lock);
+}
+
+
+/*
+ * Reading.
+ */
+
+struct sfs_trace {
+    void *map;
+    size_t maplen;
+    const struct sfs_trace_rec *recs;
+    uint64_t nrecords;
+    uint64_t pos, end;
+
+    char **names;           /* Indexed by path id */
+    size_t names_cap;
+};
+
+struct sfs_trace *sfs_trace_open(const char *filename)
+{
+    struct stat st;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < SFS_TRACE_DATA_OFF) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const struct sfs_trace_header *hdr = map;
+    if (memcmp(hdr->magic, SFS_TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != SFS_TRACE_VERSION ||
+        hdr->rec_size != sizeof(struct sfs_trace_rec) ||
+        hdr->nrecords == 0 ||
+        hdr->nrecords >
+            ((size_t)st.st_size - SFS_TRACE_DATA_OFF) / hdr->rec_size) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct sfs_trace *trace = calloc(1, sizeof(*trace));
+    if (trace == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    trace->map = map;
+    trace->maplen = st.st_size;
+    trace->recs = (const struct sfs_trace_rec *)((char *)map + SFS_TRACE_DATA_OFF);
+    trace->nrecords = hdr->nrecords;
+    trace->end = hdr->head;
+    trace->pos = hdr->head > hdr->nrecords ? hdr->head - hdr->nrecords : 0;
+    return trace;
+}
+
+void sfs_trace_close(struct sfs_trace *trace)
+{
+    for (size_t i = 0; i < trace->names_cap; i++)
+        free(trace->names[i]);
+    free(trace->names);
+    munmap(trace->map, trace->maplen);
+    free(trace);
+}
+
+static const char *trace_path(struct sfs_trace *trace, uint64_t id)
+{
+    return id < trace->names_cap ? trace->names[id] : NULL;
+}
+
+/*
+ * Read the definition of a path, whose SFS_TRACE_PATH record was just
+ * consumed. Returns 0 if its name was cut off by the end of the trace.
+ */
+static int read_path(struct sfs_trace *trace, const struct sfs_trace_rec *rec)
+{
+    size_t len = rec->size;
+    uint64_t nslots = (len + SFS_TRACE_PATHDATA_LEN - 1) / SFS_TRACE_PATHDATA_LEN;
+
+    if (trace->end - trace->pos < nslots)
+        return 0;
+
+    if (rec->path >= trace->names_cap) {
+        size_t cap = trace->names_cap ? trace->names_cap : 1024;
+        while (cap <= rec->path)
+            cap *= 2;
+        char **names = realloc(trace->names, cap * sizeof(*names));
+        if (names == NULL)
+            return 0;
+        memset(names + trace->names_cap, 0,
+               (cap - trace->names_cap) * sizeof(*names));
+        trace->names = names;
+        trace->names_cap = cap;
+    }
+
+    char *name = malloc(len + 1);
+    if (name == NULL)
+        return 0;
+    for (size_t off = 0; off < len; off += SFS_TRACE_PATHDATA_LEN) {
+        const struct sfs_trace_pathdata *data = (const struct sfs_trace_pathdata *)
+            &trace->recs[trace->pos++ % trace->nrecords];
+        size_t n = len - off < SFS_TRACE_PATHDATA_LEN ? len - off
+                                                      : SFS_TRACE_PATHDATA_LEN;
+        memcpy(name + off, data->data, n);
+    }
+    name[len] = '\0';
+
+    free(trace->names[rec->path]);
+    trace->names[rec->path] = name;
+    return 1;
+}
+
+int sfs_trace_next(struct sfs_trace *trace, struct sfs_trace_op *op)
+{
+    while (trace->pos < trace->end) {
+        const struct sfs_trace_rec *rec =
+            &trace->recs[trace->pos++ % trace->nrecords];
+
+        /* The ring may start halfway through the name of a path. An op of 0
+         * is a slot taken by an operation that never finished. */
+        if (rec->op == SFS_TRACE_PATHDATA || rec->op == 0)
+            continue;
+        if (rec->op == SFS_TRACE_PATH) {
+            if (!read_path(trace, rec))
+                return 0;
+            continue;
+        }
+
+        op->op = rec->op;
+        op->flags = rec->flags;
+        op->path = trace_path(trace, rec->path);
+        op->path2 = rec->flags & SFS_TRACE_XCLONE ? trace_path(trace, rec->offset)
+                                                  : NULL;
+        op->fh = rec->fh;
+        op->size = rec->size;
+        op->latency = rec->latency;
+        op->result = rec->result;
+        op->time = rec->time;
+        op->offset = rec->offset;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+#ifndef SFS_TRACE_H
+#define SFS_TRACE_H
+
+/*
+ * Traces of the operations done on a mounted filesystem, as recorded by
+ * `sfs --trace=FILE` and replayed by sfs_replay.
+ *
+ * A trace file is a header followed by a ring of fixed-size records, so a
+ * long-running daemon keeps only the most recent operations. Paths are not
+ * stored in every record: the first time a path is used, it is written out
+ * once as a SFS_TRACE_PATH record (followed by SFS_TRACE_PATHDATA records
+ * holding its name) and given an id, which later records refer to. A path is
+ * written out again once its definition is halfway through the ring, so only
+ * the oldest records can refer to paths that are gone.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SFS_TRACE_MAGIC     "SFSTRACE"
+#define SFS_TRACE_VERSION   1
+#define SFS_TRACE_DATA_OFF  64
+
+enum sfs_trace_opcode {
+    SFS_TRACE_PATH = 1,
+    SFS_TRACE_PATHDATA,
+    SFS_TRACE_GETATTR,
+    SFS_TRACE_READDIR,
+    SFS_TRACE_READ,
+    SFS_TRACE_WRITE,
+    SFS_TRACE_MKDIR,
+    SFS_TRACE_RMDIR,
+    SFS_TRACE_UNLINK,
+    SFS_TRACE_TRUNCATE,
+    SFS_TRACE_CREATE,
+    SFS_TRACE_OPEN,
+    SFS_TRACE_FLUSH,
+    SFS_TRACE_FSYNC,
+    SFS_TRACE_RELEASE,
+    SFS_TRACE_RENAME,
+    SFS_TRACE_GETXATTR,
+    SFS_TRACE_SETXATTR,
+    SFS_TRACE_STATFS,
+    SFS_TRACE_NOPS
+};
+
+/* Flags of a record */
+#define SFS_TRACE_HANDLE        0x1     /* Done on an open file (fh is valid) */
+#define SFS_TRACE_XCOMPRESS     0x2     /* (Get/set)xattr of user.sfs.compress */
+#define SFS_TRACE_XCLONE        0x4     /* Setxattr of user.sfs.clone */
+
+struct sfs_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t nrecords;      /* Size of the ring */
+    uint64_t head;          /* Records written so far; the next goes into slot
+                               head % nrecords */
+    uint64_t start;         /* CLOCK_REALTIME in ns when tracing started */
+    char pad[SFS_TRACE_DATA_OFF - 40];
+};
+
+/*
+ * One operation. The meaning of the fields depends on the op:
+ *  - offset and size are those of read and write. Truncate keeps the new
+ *    size in offset, open the access mode (O_RDONLY etc.) in size, and
+ *    setxattr the value set for compress in size, or the path id of the
+ *    source for clone in offset.
+ *  - fh identifies the open file for ops with SFS_TRACE_HANDLE set, and for
+ *    open and create.
+ *  - time is when the op started, in ns since tracing started, and latency
+ *    how long it took in ns (saturated at UINT32_MAX).
+ * For SFS_TRACE_PATH, path is the id being defined and size the length of
+ * the name, which follows in the data of the next SFS_TRACE_PATHDATA records.
+ */
+struct sfs_trace_rec {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t path;
+    uint32_t fh;
+    uint32_t size;
+    uint32_t latency;
+    int32_t result;
+    uint64_t time;
+    uint64_t offset;
+};
+
+#define SFS_TRACE_PATHDATA_LEN  (sizeof(struct sfs_trace_rec) - 1)
+
+struct sfs_trace_pathdata {
+    uint8_t op;
+    char data[SFS_TRACE_PATHDATA_LEN];
+};
+
+
+/*
+ * Recording. sfs_trace_start() creates (or overwrites) the trace file with
+ * room for `nrecords` records, and sfs_trace_record() adds an operation that
+ * started at `start` (taken with sfs_trace_now()). Records may be added from
+ * several threads at once. Paths may be NULL.
+ *
+ * Operations on the image are recorded in the order they ran on it, as long as
+ * sfs_trace_order() is set as the lock hook of the image (see libsfs.h) and
+ * every operation is bracketed by sfs_trace_begin() and sfs_trace_record() in
+ * the thread that runs it; the paths given to both must be the same. So
+ * replaying a trace in order repeats what happened, also for a multithreaded
+ * mount. Their `time` is when they started, which is not necessarily in that
+ * order. Operations that never take the lock of the image are recorded when
+ * they finish.
+ */
+int sfs_trace_start(const char *filename, uint64_t nrecords);
+void sfs_trace_stop(void);
+uint64_t sfs_trace_now(void);
+void sfs_trace_begin(const char *path, const char *path2);
+void sfs_trace_order(void *arg);
+void sfs_trace_record(int op, int flags, const char *path, const char *path2,
+                      uint64_t fh, uint64_t offset, uint64_t size,
+                      uint64_t start, int result);
+
+
+/*
+ * Reading. sfs_trace_open() returns NULL and sets errno on error.
+ * sfs_trace_next() returns the operations in the order they ran, with their paths
+ * resolved, and 0 once the end is reached. A path is NULL if its definition
+ * was already overwritten in the ring.
+ */
+struct sfs_trace_op {
+    int op;
+    int flags;
+    const char *path;
+    const char *path2;      /* Source path of a clone */
+    uint32_t fh;
+    uint32_t size;
+    uint32_t latency;
+    int32_t result;
+    uint64_t time;
+    uint64_t offset;
+};
+
+struct sfs_trace;
+
+struct sfs_trace *sfs_trace_open(const char *filename);
+void sfs_trace_close(struct sfs_trace *trace);
+int sfs_trace_next(struct sfs_trace *trace, struct sfs_trace_op *op);
+
+const char *sfs_trace_op_name(int op);
+
+#endif /* SFS_TRACE_H */